@@ -36,6 +36,12 @@
 #define CEP_RAW    0
 #define CEP_DGRAM  1
 #define CEP_STREAM 2
+#define CEP_SEQPACKET 3
+
+/* Defaults of D-Bus readers: the largest message accepted */
+/* and how far to read ahead of the messages delivered. */
+#define CEP_READER_MAXMESSAGE  134217728
+#define CEP_READER_MAXBUFFERED 16777216
 
 /* Careful! These shorcut macros assume */
 /* that a variable 'Tcl_Interp *interp' exists.*/
@@ -76,6 +82,24 @@ EXTERN Tcl_Channel      MakeCepClientChannel (ClientData sock, int cepDomain, in
 
 EXTERN int              Cep_Sendto (Tcl_Channel chan, const char *host, int port, const unsigned char *data, int dataLen);
 
+EXTERN int              Cep_Send (Tcl_Channel chan, const unsigned char *data, int dataLen);
+
+EXTERN int              Cep_Recv (Tcl_Channel chan, Tcl_Obj *objPtr);
+
+EXTERN int              Cep_Writev (Tcl_Channel chan, int objc, Tcl_Obj *const objv[]);
+
+EXTERN int              Cep_ReaderStart _ANSI_ARGS_((Tcl_Interp * interp, Tcl_Channel chan,
+						     int maxMessage, int maxBuffered,
+						     Tcl_Obj *scriptPtr));
+
+EXTERN int              Cep_ReaderPause _ANSI_ARGS_((Tcl_Interp * interp, Tcl_Channel chan, int pause));
+
+EXTERN int              Cep_ReaderStop _ANSI_ARGS_((Tcl_Interp * interp, Tcl_Channel chan));
+
+EXTERN int              Cep_SetNotifier _ANSI_ARGS_((Tcl_Interp * interp, const char *name));
+
+EXTERN const char *     Cep_GetNotifier _ANSI_ARGS_((void));
+
 EXTERN int              Ceptcl_Init _ANSI_ARGS_((Tcl_Interp * interp));
 
 EXTERN int              Ceptcl_SafeInit _ANSI_ARGS_((Tcl_Interp * interp));
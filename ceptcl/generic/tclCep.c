@@ -33,6 +33,12 @@ typedef struct AcceptCallback {
   Tcl_Interp *interp;                 /* Interpreter in which to run it. */
 } AcceptCallback;
 
+/*
+ * getservbyname() returns static data.
+ */
+
+TCL_DECLARE_MUTEX(servMutex)
+
 /*
  * Static functions for this file:
  */
@@ -50,6 +56,9 @@ static void     CepAcceptCallbacksDeleteProc _ANSI_ARGS_((
 
 static void     CepServerCloseProc _ANSI_ARGS_((ClientData callbackData));
 
+static Tcl_Obj *CallbackCommand _ANSI_ARGS_((Tcl_Interp *interp,
+                    int objc, Tcl_Obj *const objv[]));
+
 static void     UnregisterCepServerInterpCleanupProc _ANSI_ARGS_((
                     Tcl_Interp *interp, AcceptCallback *acceptCallbackPtr));
 
@@ -57,6 +66,15 @@ static int      Cep_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int
 
 static int      Sendto_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
 
+static int      Notifier_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+
+static int      Geteuid_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+static Tcl_Channel GetCepChannel _ANSI_ARGS_((Tcl_Interp *interp, Tcl_Obj *objPtr, int mask));
+static int      Send_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+static int      Recv_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+static int      Writev_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+static int      Dbusreader_Cmd _ANSI_ARGS_((ClientData notUsed, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]));
+
 static int      _TCL_SockGetPort _ANSI_ARGS_((Tcl_Interp *interp, const char *string, const char *proto, int *portPtr));
 
 
@@ -101,10 +119,14 @@ _TCL_SockGetPort (interp, string, proto, portPtr)
 	 */
 	 
 	native = Tcl_UtfToExternalDString(NULL, string, -1, &ds);
+	Tcl_MutexLock(&servMutex);
 	sp = getservbyname(native, proto);		/* INTL: Native. */
-	Tcl_DStringFree(&ds);
 	if (sp != NULL) {
 	    *portPtr = ntohs((unsigned short) sp->s_port);
+	}
+	Tcl_MutexUnlock(&servMutex);
+	Tcl_DStringFree(&ds);
+	if (sp != NULL) {
 	    return TCL_OK;
 	}
     }
@@ -291,6 +313,51 @@ CepServerCloseProc (callbackData)
     ckfree((char *) acceptCallbackPtr);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * CallbackCommand --
+ *
+ *	Builds the command to evaluate for a server or receiver callback:
+ *	the callback script (objv[0]), which may be a command prefix
+ *	of several words, with the remaining objv elements appended
+ *	as separate words.
+ *
+ * Results:
+ *	The command with its reference count incremented, or NULL
+ *	(with an error message left in interp) if the script is not
+ *	a valid list.
+ *
+ * Side effects:
+ *	Takes ownership of the objv elements.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+CallbackCommand (interp, objc, objv)
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *const objv[];
+{
+    Tcl_Obj *cmdObj;
+    int i;
+
+    cmdObj = objv[0];
+    Tcl_IncrRefCount(cmdObj);
+    for (i = 1; i < objc; i++) {
+	if (Tcl_ListObjAppendElement(interp, cmdObj, objv[i]) != TCL_OK) {
+	    for (; i < objc; i++) {
+		Tcl_IncrRefCount(objv[i]);
+		Tcl_DecrRefCount(objv[i]);
+	    }
+	    Tcl_DecrRefCount(cmdObj);
+	    return NULL;
+	}
+    }
+    return cmdObj;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -328,6 +395,7 @@ AcceptCallbackProc (callbackData, chan, addr, port, cepDomain, euid, egid, data)
     char *tscript;
     int result;
     Tcl_Obj *cmd[4];
+    Tcl_Obj *cmdObj;
 
     acceptCallbackPtr = (AcceptCallback *) callbackData;
 
@@ -365,7 +433,13 @@ AcceptCallbackProc (callbackData, chan, addr, port, cepDomain, euid, egid, data)
 
         Tcl_RegisterChannel((Tcl_Interp *) NULL,  chan);
         
-	result = Tcl_EvalObjv(tinterp, 4, cmd, TCL_EVAL_GLOBAL);
+	cmdObj = CallbackCommand(tinterp, 4, cmd);
+	if (cmdObj == NULL) {
+	    result = TCL_ERROR;
+	} else {
+	    result = Tcl_EvalObjEx(tinterp, cmdObj, TCL_EVAL_GLOBAL);
+	    Tcl_DecrRefCount(cmdObj);
+	}
 
         if (result != TCL_OK) {
             Tcl_BackgroundError(tinterp);
@@ -428,6 +502,7 @@ ReceiverCallbackProc (callbackData, chan, addr, port, cepDomain, euid, egid, dat
     char *tscript;
     int result;
     Tcl_Obj *cmd[6];
+    Tcl_Obj *cmdObj;
 
     acceptCallbackPtr = (AcceptCallback *) callbackData;
 
@@ -458,7 +533,13 @@ ReceiverCallbackProc (callbackData, chan, addr, port, cepDomain, euid, egid, dat
 
         Tcl_RegisterChannel((Tcl_Interp *) NULL,  chan);
         
-	result = Tcl_EvalObjv(tinterp, 6, cmd, TCL_EVAL_GLOBAL);
+	cmdObj = CallbackCommand(tinterp, 6, cmd);
+	if (cmdObj == NULL) {
+	    result = TCL_ERROR;
+	} else {
+	    result = Tcl_EvalObjEx(tinterp, cmdObj, TCL_EVAL_GLOBAL);
+	    Tcl_DecrRefCount(cmdObj);
+	}
 
         if (result != TCL_OK) {
             Tcl_BackgroundError(tinterp);
@@ -637,10 +718,10 @@ Cep_Cmd (notUsed, interp, objc, objv)
     }
     case CEP_TYPE: {
       static const char *typeOptions[] = {
-	"datagram", "raw", "stream", (char *) NULL
+	"datagram", "raw", "seqpacket", "stream", (char *) NULL
       };
       enum typeOptions {
-	TYPE_DGRAM, TYPE_RAW, TYPE_STREAM
+	TYPE_DGRAM, TYPE_RAW, TYPE_SEQPACKET, TYPE_STREAM
       };
       int typeIndex;
       a++;
@@ -660,6 +741,10 @@ Cep_Cmd (notUsed, interp, objc, objv)
 	cepType = CEP_STREAM;
 	break;
       }
+      case TYPE_SEQPACKET: {
+	cepType = CEP_SEQPACKET;
+	break;
+      }
       case TYPE_RAW: {
 	cepType = CEP_RAW;
 	break;
@@ -706,10 +791,13 @@ Cep_Cmd (notUsed, interp, objc, objv)
 	cepType = CEP_DGRAM;
       }
     }
+    if (cepType == CEP_SEQPACKET) {
+      return qseterr("cannot use type seqpacket with receiver ceps");
+    }
   }
 
   if (myportName != NULL) {
-    if (_TCL_SockGetPort(interp, myportName, (cepType == CEP_STREAM ? "tcp" : "udp"), &myport) != TCL_OK) {
+    if (_TCL_SockGetPort(interp, myportName, (cepType == CEP_DGRAM || cepType == CEP_RAW ? "udp" : "tcp"), &myport) != TCL_OK) {
       return TCL_ERROR;
     }
   }
@@ -730,7 +818,7 @@ Cep_Cmd (notUsed, interp, objc, objv)
   }
 
   if (a < objc) {
-    if (_TCL_SockGetPort(interp, (const char *) Tcl_GetString(objv[a]), (cepType == CEP_STREAM ? "tcp" : "udp"), &port) != TCL_OK) {
+    if (_TCL_SockGetPort(interp, (const char *) Tcl_GetString(objv[a]), (cepType == CEP_DGRAM || cepType == CEP_RAW ? "udp" : "tcp"), &port) != TCL_OK) {
       return TCL_ERROR;
     }
     a++;
@@ -877,6 +965,407 @@ Sendto_Cmd (notUsed, interp, objc, objv)
   return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Notifier_Cmd --
+ *
+ *      Queries or selects the notifier used to watch ceps created
+ *      afterwards: "tcl" or "epoll".
+ *
+ * Results:
+ *      A standard Tcl result. The name of the current notifier
+ *      is returned.
+ *
+ * Side effects:
+ *      See Cep_SetNotifier.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Notifier_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  if (objc > 2) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " ?notifier?\"", (char *) NULL);
+  }
+
+  if (objc == 2 && Cep_SetNotifier(interp, Tcl_GetString(objv[1])) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(Cep_GetNotifier(), -1));
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Geteuid_Cmd --
+ *
+ *      Returns the effective user ID of the process, which is what
+ *      the peer of a local cep sees with -peereid.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Geteuid_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  if (objc != 1) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    "\"", (char *) NULL);
+  }
+
+  Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) geteuid()));
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetCepChannel --
+ *
+ *      Looks up the channel named by objPtr and makes sure it is
+ *      a cep without data held in the buffers of the channel in the
+ *      direction given by mask (TCL_READABLE for input, TCL_WRITABLE
+ *      for output), which commands talking directly to the cep would
+ *      otherwise reorder.  Data buffered in the other direction is
+ *      no conflict: a stream cep routinely has input read ahead while
+ *      it is written to.
+ *
+ * Results:
+ *      The channel, or NULL with an error message in interp.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Channel
+GetCepChannel (interp, objPtr, mask)
+     Tcl_Interp *interp;		/* Current interpreter. */
+     Tcl_Obj *objPtr;			/* Name of the channel. */
+     int mask;				/* TCL_READABLE and/or TCL_WRITABLE. */
+{
+  Tcl_Channel chan;
+
+  chan = Tcl_GetChannel(interp, Tcl_GetString(objPtr), NULL);
+  if (chan == NULL) {
+    return NULL;
+  }
+  if (strcmp(Tcl_GetChannelType(chan)->typeName, "cep") != 0) {
+    Cep_SetInterpResultError(interp, "channel \"", Tcl_GetString(objPtr),
+			     "\" is not a cep", (char *) NULL);
+    return NULL;
+  }
+  if (((mask & TCL_READABLE) && Tcl_InputBuffered(chan) > 0)
+      || ((mask & TCL_WRITABLE) && Tcl_OutputBuffered(chan) > 0)) {
+    Cep_SetInterpResultError(interp, "channel \"", Tcl_GetString(objPtr),
+			     "\" has buffered data", (char *) NULL);
+    return NULL;
+  }
+
+  return chan;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Send_Cmd --
+ *
+ *      This procedure is invoked to process the "cep::send" Tcl command:
+ *      sends a message with a single system call, which makes it
+ *      a single packet on seqpacket ceps.
+ *
+ * Results:
+ *      A standard Tcl result: the number of bytes sent.
+ *
+ * Side effects:
+ *      Sends data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Send_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  Tcl_Channel chan;
+  const unsigned char *data;
+  int dataLen;
+
+  if (objc != 3) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " channelId message\"", (char *) NULL);
+  }
+
+  chan = GetCepChannel(interp, objv[1], TCL_WRITABLE);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+
+  data = Tcl_GetByteArrayFromObj(objv[2], &dataLen);
+
+  dataLen = Cep_Send(chan, data, dataLen);
+  if (dataLen == -1) {
+    return Cep_SetInterpResultErrorPosix(interp, "error sending to \"", Tcl_GetString(objv[1]),
+					 "\": ", (char *) NULL);
+  }
+
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(dataLen));
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Writev_Cmd --
+ *
+ *      This procedure is invoked to process the "cep::writev" Tcl
+ *      command: writes a list of byte strings with a single system call
+ *      without copying them into the buffer of the channel.
+ *
+ * Results:
+ *      A standard Tcl result: the number of bytes written, which is
+ *      less than the total length of the list on a partial write.
+ *
+ * Side effects:
+ *      Writes data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Writev_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  Tcl_Channel chan;
+  Tcl_Obj **chunks;
+  int nchunks;
+  int written;
+
+  if (objc != 3) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " channelId chunkList\"", (char *) NULL);
+  }
+
+  chan = GetCepChannel(interp, objv[1], TCL_WRITABLE);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+
+  if (Tcl_ListObjGetElements(interp, objv[2], &nchunks, &chunks) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  written = 0;
+  if (nchunks > 0) {
+    written = Cep_Writev(chan, nchunks, chunks);
+    if (written == -1) {
+      return Cep_SetInterpResultErrorPosix(interp, "error writing \"", Tcl_GetString(objv[1]),
+					   "\": ", (char *) NULL);
+    }
+  }
+
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(written));
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Recv_Cmd --
+ *
+ *      This procedure is invoked to process the "cep::recv" Tcl command:
+ *      receives the next packet of a cep whole, with a single read
+ *      into a buffer of the right size.
+ *
+ * Results:
+ *      A standard Tcl result: the packet as a byte array, which is
+ *      empty at end of file.
+ *
+ * Side effects:
+ *      Consumes a packet.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Recv_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  Tcl_Channel chan;
+  Tcl_Obj *packet;
+
+  if (objc != 2) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " channelId\"", (char *) NULL);
+  }
+
+  chan = GetCepChannel(interp, objv[1], TCL_READABLE);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+
+  packet = Tcl_NewByteArrayObj(NULL, 0);
+  if (Cep_Recv(chan, packet) == -1) {
+    Cep_SetInterpResultErrorPosix(interp, "error receiving from \"", Tcl_GetString(objv[1]),
+				  "\": ", (char *) NULL);
+    Tcl_DecrRefCount(packet);
+    return TCL_ERROR;
+  }
+
+  Tcl_SetObjResult(interp, packet);
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbusreader_Cmd --
+ *
+ *      This procedure is invoked to process the "cep::dbusreader" Tcl
+ *      command: starts, pauses, resumes or stops a thread reading
+ *      D-Bus messages from a stream cep.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See Cep_ReaderStart, Cep_ReaderPause and Cep_ReaderStop.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Dbusreader_Cmd (notUsed, interp, objc, objv)
+     ClientData notUsed;		/* Not used. */
+     Tcl_Interp *interp;		/* Current interpreter. */
+     int objc;				/* Number of arguments. */
+     Tcl_Obj *const objv[];		/* Argument objects. */
+{
+  static const char *readerCmds[] = {
+    "pause", "resume", "start", "stop", (char *) NULL
+  };
+  enum readerCmds {
+    READER_PAUSE, READER_RESUME, READER_START, READER_STOP
+  };
+  static const char *readerOptions[] = {
+    "-maxbuffered", "-maxmessage", (char *) NULL
+  };
+  enum readerOptions {
+    READER_MAXBUFFERED, READER_MAXMESSAGE
+  };
+
+  Tcl_Channel chan;
+  int cmdIndex;
+  int optionIndex;
+  int maxMessage = CEP_READER_MAXMESSAGE;
+  int maxBuffered = CEP_READER_MAXBUFFERED;
+  int value;
+  int a;
+
+  if (objc < 3) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " option channelId ?arg ...?\"", (char *) NULL);
+  }
+
+  if (Tcl_GetIndexFromObj(interp, objv[1], readerCmds,
+			  "option", TCL_EXACT, &cmdIndex) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  chan = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), NULL);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+  if (strcmp(Tcl_GetChannelType(chan)->typeName, "cep") != 0) {
+    return Cep_SetInterpResultError(interp, "channel \"", Tcl_GetString(objv[2]),
+				    "\" is not a cep", (char *) NULL);
+  }
+
+  if ((enum readerCmds) cmdIndex != READER_START) {
+    if (objc != 3) {
+      return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				      " ", Tcl_GetString(objv[1]), " channelId\"", (char *) NULL);
+    }
+    switch ((enum readerCmds) cmdIndex) {
+    case READER_PAUSE:
+      return Cep_ReaderPause(interp, chan, 1);
+    case READER_RESUME:
+      return Cep_ReaderPause(interp, chan, 0);
+    default:
+      return Cep_ReaderStop(interp, chan);
+    }
+  }
+
+  for (a = 3; a < objc - 1; a += 2) {
+    if (Tcl_GetIndexFromObj(interp, objv[a], readerOptions,
+			    "option", TCL_EXACT, &optionIndex) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (a + 1 >= objc - 1) {
+      return Cep_SetInterpResultError(interp, "no argument given for ", Tcl_GetString(objv[a]),
+				      " option", (char *) NULL);
+    }
+    if (Tcl_GetIntFromObj(interp, objv[a + 1], &value) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    switch ((enum readerOptions) optionIndex) {
+    case READER_MAXBUFFERED:
+      if (value < 1) {
+	return qseterr("-maxbuffered must be positive");
+      }
+      maxBuffered = value;
+      break;
+    case READER_MAXMESSAGE:
+      if ((value < 16) || (value > CEP_READER_MAXMESSAGE)) {
+	return qseterr("-maxmessage must be between 16 and 134217728");
+      }
+      maxMessage = value;
+      break;
+    }
+  }
+  if (a != objc - 1) {
+    return Cep_SetInterpResultError(interp, "Wrong # args: should be \"", Tcl_GetString(objv[0]),
+				    " start channelId ?-maxmessage bytes? ?-maxbuffered bytes? script\"",
+				    (char *) NULL);
+  }
+
+  return Cep_ReaderStart(interp, chan, maxMessage, maxBuffered, objv[objc - 1]);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -917,6 +1406,18 @@ Ceptcl_Init (Tcl_Interp *interp)
 		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
   Tcl_CreateObjCommand(interp, "sendto", Sendto_Cmd,
 		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::notifier", Notifier_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::geteuid", Geteuid_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::send", Send_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::recv", Recv_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::writev", Writev_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+  Tcl_CreateObjCommand(interp, "::cep::dbusreader", Dbusreader_Cmd,
+		       (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
 
   return TCL_OK;
 }
@@ -19,6 +19,12 @@
 
 /* Most of the include/define stuff was taken from unix/tclUnixPort.h */
 /* I'm not sure if I really need all of it */
+
+/* glibc only declares accept4() with _GNU_SOURCE */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 
@@ -64,17 +70,27 @@
 #endif
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
 #include <tcl.h>
 
 #include "../generic/ceptcl.h"
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define CEP_HAVE_EPOLL 1
+#endif
+
 
 #ifdef SO_REUSEPORT
 #  define CEP_REUSEPORT SO_REUSEPORT
@@ -82,6 +98,13 @@
 #  define CEP_REUSEPORT SO_REUSEADDR
 #endif
 
+/* BSDs call TCP_CORK TCP_NOPUSH */
+#if defined(TCP_CORK)
+#  define CEP_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+#  define CEP_TCP_CORK TCP_NOPUSH
+#endif
+
 /* This little bit is from generic/tclIO.h */
 /* I'm not sure that it's needed */
 /*
@@ -131,6 +154,55 @@ error one of EWOULDBLOCK or EAGAIN must be defined
 
 #define SOCKET_BUFSIZE	4096
 
+/*
+ * The default number of connections a server cep accepts per
+ * readable event (see the -acceptbatch option).
+ */
+
+#define CEP_ACCEPT_BATCH 16
+
+/*
+ * The default number of datagrams a receiver cep takes per readable
+ * event (see the -recvbatch option), and the size of the buffers they
+ * are received into by recvmmsg(), which is large enough for any
+ * IP datagram.
+ */
+
+#define CEP_RECV_BATCH     16
+#define CEP_RECV_BATCH_MAX 1024
+#define CEP_RECV_SLOT      65536
+
+/*
+ * The number of buffers Cep_Writev hands to a single writev() call.
+ */
+
+#ifdef IOV_MAX
+#  define CEP_IOV_MAX IOV_MAX
+#else
+#  define CEP_IOV_MAX 16
+#endif
+#define CEP_IOV_STATIC 64
+
+/*
+ * Host names given to asynchronously connecting ceps are looked up
+ * on a worker thread, and the addresses found are reused for that
+ * many seconds.
+ */
+
+#ifdef TCL_THREADS
+#  define CEP_ASYNC_RESOLVE 1
+#endif
+#define CEP_RESOLVE_TTL 60
+
+/*
+ * A D-Bus reader thread reads this much at once.
+ */
+
+#ifdef TCL_THREADS
+#  define CEP_DBUS_READER 1
+#endif
+#define CEP_READER_CHUNK 65536
+
 /*
  * Define FD_CLOEEXEC (the close-on-exec flag bit) if it isn't
  * already defined.
@@ -191,6 +263,63 @@ error one of EWOULDBLOCK or EAGAIN must be defined
 #define CEP_CHANNELNAME_MAX (16 + TCL_INTEGER_SPACE)
 #define CEP_HOSTNAME_MAX (NI_MAXHOST + 1)
 
+/*
+ * This structure describes a host name lookup done on a worker thread
+ * for an asynchronously connecting cep. It's shared by the cep, the
+ * worker thread and the event reporting the outcome to the thread
+ * of the cep, and is freed by the last of them to let go of it.
+ */
+
+typedef struct CepResolve {
+  struct CepState *statePtr;	/* The cep waiting for the lookup, or
+				 * NULL once it no longer does. */
+  Tcl_ThreadId threadId;	/* Thread the cep belongs to. */
+  char *host;			/* Host name in the system encoding. */
+  char *key;			/* Key of the address cache. */
+  int family;
+  int type;
+  int port;
+  int mask;			/* Events to watch once connecting. */
+  int done;			/* Set when the lookup is over. */
+  int error;			/* POSIX error code if it failed. */
+  struct sockaddr_storage sockaddr;
+  socklen_t size;
+  Tcl_Condition cond;		/* Notified when done is set. */
+  int refCount;
+} CepResolve;
+
+/*
+ * This structure describes a thread reading D-Bus messages from a stream
+ * cep on behalf of the thread the cep belongs to. The fields up to
+ * maxBuffered are set up when the reader starts and never change while
+ * it runs; the reader thread and the thread of the cep share the next
+ * ones under readerMutex; the buffer belongs to the reader thread
+ * while it runs.
+ */
+
+typedef struct CepReader {
+  struct CepState *statePtr;	/* The cep read from. */
+  int fd;
+  Tcl_ThreadId ownerId;		/* Thread the cep belongs to. */
+  Tcl_ThreadId threadId;	/* The reader thread. */
+  Tcl_Interp *interp;		/* Interpreter to run script in. */
+  Tcl_Obj *scriptPtr;		/* Prefix of the command reporting
+				 * messages. */
+  int wakeFds[2];		/* Pipe to wake the reader thread up. */
+  int maxMessage;		/* Largest message accepted. */
+  int maxBuffered;		/* Stop reading once that many bytes
+				 * are waiting to be delivered. */
+  int paused;			/* Set while nothing is delivered. */
+  int stopping;			/* Set to make the reader thread exit. */
+  int queued;			/* Bytes waiting to be delivered. */
+  Tcl_Condition cond;		/* Notified when the above change. */
+  unsigned char *buf;		/* Data read but not yet framed. */
+  int bufLen;
+  int bufSize;
+  int pending;			/* Size of the message the buffer
+				 * starts, if it's incomplete. */
+} CepReader;
+
 /*
  * This structure describes per-instance state of a cep based channel.
  */
@@ -203,8 +332,83 @@ typedef struct CepState {
   int protocol;
   CepAcceptProc *acceptProc;	/* Proc to call on accept. */
   ClientData acceptProcData;	/* The data for the accept proc. */
+  int watchMask;		/* Events registered with epoll. */
+  int acceptBatch;		/* Max connections accepted per event. */
+  int recvBatch;		/* Max datagrams received per event. */
+  unsigned char *recvBufs;	/* recvBatch buffers of CEP_RECV_SLOT
+				 * bytes for receiver ceps, or NULL. */
+  CepResolve *resolvePtr;	/* Lookup of the host to connect to,
+				 * while in progress. */
+  int connectError;		/* Why the asynchronous connect failed
+				 * before it could be started. */
+  int interest;			/* Events Tcl last asked to watch. */
+  CepReader *readerPtr;		/* D-Bus reader thread, if running. */
 } CepState;
 
+#ifdef CEP_ASYNC_RESOLVE
+/*
+ * The event queued to the thread of a cep when the lookup of the host
+ * it connects to is over.
+ */
+
+typedef struct ResolveEvent {
+  Tcl_Event header;
+  CepResolve *resolvePtr;
+} ResolveEvent;
+
+/*
+ * An address found by a lookup, kept in the address cache.
+ */
+
+typedef struct ResolveCacheEntry {
+  long expires;			/* Time when the entry goes stale. */
+  struct sockaddr_storage sockaddr;
+  socklen_t size;
+} ResolveCacheEntry;
+
+/*
+ * The address cache maps the address family and the host name to
+ * the address last found for them. It's shared by all threads.
+ */
+
+TCL_DECLARE_MUTEX(resolveMutex)
+static Tcl_HashTable resolveCache;
+static int resolveCacheInitialized = 0;
+#endif
+
+#ifdef CEP_DBUS_READER
+/*
+ * What a reader thread reports to the thread of its cep.
+ */
+
+#define CEP_READER_MESSAGE   0
+#define CEP_READER_EOF       1
+#define CEP_READER_MALFORMED 2
+#define CEP_READER_ERROR     3
+
+static const char *readerStatusNames[] = {
+  "message", "eof", "malformed", "error"
+};
+
+typedef struct ReaderEvent {
+  Tcl_Event header;
+  CepReader *readerPtr;		/* NULL once being delivered. */
+  int status;			/* One of CEP_READER_*. */
+  char *data;			/* The message, or why the stream is
+				 * malformed. */
+  int length;
+  int error;			/* POSIX error code for errors. */
+} ReaderEvent;
+
+TCL_DECLARE_MUTEX(readerMutex)
+#endif
+
+/*
+ * getprotobyname() and getprotobynumber() return static data.
+ */
+
+TCL_DECLARE_MUTEX(netdbMutex)
+
 
 /*
  * These bits may be ORed together into the "flags" field of a CepState
@@ -213,16 +417,19 @@ typedef struct CepState {
 
 /*
  *
- *  uuuu ttt ddd 111111
- *  |||| ||| ||| ||||||- Asynchronous cep
- *  |||| ||| ||| |||||-- Async connect in progress
- *  |||| ||| ||| ||||--- Cep is server.
- *  |||| ||| ||| |||---- Read is shut down
- *  |||| ||| ||| ||----- Write is shut down
- *  |||| ||| ||| |------ Resolve names
- *  |||| ||| |||-------- Domain
- *  |||| |||------------ Type
- *  ||||---------------- Undefined
+ *  u l r e ttt ddd 111111
+ *  | | | | ||| ||| ||||||- Asynchronous cep
+ *  | | | | ||| ||| |||||-- Async connect in progress
+ *  | | | | ||| ||| ||||--- Cep is server.
+ *  | | | | ||| ||| |||---- Read is shut down
+ *  | | | | ||| ||| ||----- Write is shut down
+ *  | | | | ||| ||| |------ Resolve names
+ *  | | | | ||| |||-------- Domain
+ *  | | | | |||------------ Type
+ *  | | | |---------------- Watched through epoll
+ *  | | |------------------ Cep is receiver
+ *  | |-------------------- Host lookup in progress
+ *  |---------------------- Undefined
  *
  */
 
@@ -239,6 +446,36 @@ typedef struct CepState {
 #define TYPE2MASK(T)       ((T & BASE_MASK) << TYPE_SHIFT)
 #define MASK2DOMAIN(M)     ((M >> DOMAIN_SHIFT) & BASE_MASK)
 #define MASK2TYPE(M)       ((M >> TYPE_SHIFT) & BASE_MASK)
+#define CEP_EPOLL_WATCH    (1 << 12) /* Watched through epoll */
+#define CEP_RECEIVER_CEP   (1 << 13) /* 1 == cep is a receiver */
+#define CEP_RESOLVING      (1 << 14) /* Host lookup in progress */
+#define CEP_IS_TCP(D, T)   (((D == CEP_INET) || (D == CEP_INET6)) && (T == CEP_STREAM))
+
+/*
+ * Readiness of ceps may be dispatched through a single epoll instance
+ * instead of registering each cep with the Tcl notifier, which is
+ * select() based on most Unix builds of Tcl and thus costs O(n) per
+ * wakeup and can't handle fds above FD_SETSIZE. Only the epoll fd
+ * itself is then registered with Tcl.
+ * Whether to use epoll is decided when a cep is created (or moved to
+ * another thread); see Cep_SetNotifier. Like the Tcl notifier, each
+ * thread has an epoll instance of its own.
+ */
+
+#ifdef CEP_HAVE_EPOLL
+#define CEP_EPOLL_MAXEVENTS 256	/* Events fetched per wakeup. */
+#endif
+
+typedef struct ThreadSpecificData {
+  int useEpoll;			/* Create new ceps with CEP_EPOLL_WATCH. */
+#ifdef CEP_HAVE_EPOLL
+  int epollFd;			/* The epoll instance, or -1. */
+  Tcl_HashTable epollTable;	/* Maps fds to CepStates. */
+#endif
+  int initialized;
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
 
 
 /*
@@ -256,6 +493,9 @@ static CepState *	CreateCep _ANSI_ARGS_((Tcl_Interp *interp,
 static void		CepAccept _ANSI_ARGS_((ClientData data, int mask));
 
 static void		CepReceiverListen _ANSI_ARGS_((ClientData data, int mask));
+static void		ReceiverDeliver _ANSI_ARGS_((CepState *statePtr,
+				struct sockaddr_storage *sockaddrPtr, socklen_t size,
+				const unsigned char *buf, ssize_t bytesRead));
 
 static int		CepBlockModeProc _ANSI_ARGS_((ClientData data,
 						      int mode));
@@ -283,6 +523,29 @@ static int		CepOutputProc _ANSI_ARGS_((ClientData instanceData,
 static void		CepWatchProc _ANSI_ARGS_((ClientData instanceData,
 						  int mask));
 
+#ifdef TCL_CHANNEL_VERSION_4
+static void		CepThreadActionProc _ANSI_ARGS_((ClientData instanceData,
+							 int action));
+#endif
+
+static ThreadSpecificData * GetThreadSpecificData _ANSI_ARGS_((void));
+
+static int		GetProtocolNumber _ANSI_ARGS_((const char *name,
+						       int *protoPtr));
+
+static int		GetProtocolName _ANSI_ARGS_((int proto,
+						     Tcl_DString *dsPtr));
+
+#ifdef CEP_HAVE_EPOLL
+static int		EpollInit _ANSI_ARGS_((Tcl_Interp *interp));
+
+static void		EpollFinalize _ANSI_ARGS_((ClientData data));
+
+static int		EpollWatch _ANSI_ARGS_((CepState *statePtr, int mask));
+
+static void		EpollDispatch _ANSI_ARGS_((ClientData data, int mask));
+#endif
+
 static int		WaitForConnect _ANSI_ARGS_((CepState *statePtr,
 						    int *errorCodePtr));
 
@@ -297,14 +560,59 @@ static Tcl_Channel	MakeCepClientChannelMode _ANSI_ARGS_(
 static int		CreateCepAddress _ANSI_ARGS_(
 						     (int cepDomain,
 						      struct sockaddr_storage *sockaddrPtr,
+						      socklen_t *sizePtr,
 						      const char *host, int port, int resolve));
 
+static const char *	LocalAddressToUtf _ANSI_ARGS_(
+						     (struct sockaddr_un *slp,
+						      socklen_t size,
+						      Tcl_DString *dsPtr));
+
 static int              CepDomainToSysDomain (int cepDomain);
 static int              SysDomainToCepDomain (int sysDomain);
 static int              CepTypeToSysType (int cepType);
 static int              SysTypeToCepType (int sysType);
 static socklen_t        GetSocketStructSize (int cepDomain);
 static int              NameToAddr (int family, const char *host, void *addrPtr, int resolve);
+#ifdef CEP_ASYNC_RESOLVE
+static void		ResolveCacheKey _ANSI_ARGS_((int family,
+			    const char *host, Tcl_DString *dsPtr));
+static int		ResolveCacheLookup _ANSI_ARGS_((int family,
+			    const char *host, int port,
+			    struct sockaddr_storage *sockaddrPtr,
+			    socklen_t *sizePtr));
+static void		ResolveCacheStore _ANSI_ARGS_((
+			    CepResolve *resolvePtr));
+static CepResolve *	StartResolve _ANSI_ARGS_((CepState *statePtr,
+			    int family, int type, const char *host,
+			    int port));
+static Tcl_ThreadCreateType ResolveThread _ANSI_ARGS_((
+			    ClientData clientData));
+static int		ResolveEventProc _ANSI_ARGS_((Tcl_Event *evPtr,
+			    int flags));
+static void		FinishResolve _ANSI_ARGS_((CepState *statePtr));
+static void		DetachResolve _ANSI_ARGS_((CepState *statePtr));
+static void		ReleaseResolve _ANSI_ARGS_((CepResolve *resolvePtr));
+static void		SetAddressPort _ANSI_ARGS_((
+			    struct sockaddr_storage *sockaddrPtr, int port));
+#endif
+#ifdef CEP_DBUS_READER
+static Tcl_ThreadCreateType ReaderThread _ANSI_ARGS_((
+			    ClientData clientData));
+static int		ReaderFrame _ANSI_ARGS_((CepReader *readerPtr,
+			    const char **reasonPtr));
+static void		ReaderPost _ANSI_ARGS_((CepReader *readerPtr,
+			    int status, const char *data, int length,
+			    int error));
+static int		ReaderEventProc _ANSI_ARGS_((Tcl_Event *evPtr,
+			    int flags));
+static int		ReaderDeleteProc _ANSI_ARGS_((Tcl_Event *evPtr,
+			    ClientData clientData));
+static void		ReaderInterpDeleted _ANSI_ARGS_((
+			    ClientData clientData, Tcl_Interp *interp));
+static void		StopReader _ANSI_ARGS_((CepState *statePtr,
+			    int keep));
+#endif
 
 static int              _TCL_SockMinimumBuffers _ANSI_ARGS_((int sock, int size));
 static int              _TCL_UnixWaitForFile _ANSI_ARGS_((int fd, int mask, int timeout));
@@ -317,7 +625,11 @@ static int              _TCL_UnixWaitForFile _ANSI_ARGS_((int fd, int mask, int
 
 static Tcl_ChannelType cepChannelType = {
   (char *) "cep",        /* Type name. */
+#ifdef TCL_CHANNEL_VERSION_4
+  TCL_CHANNEL_VERSION_4, /* v4 channel */
+#else
   TCL_CHANNEL_VERSION_2, /* v2 channel */
+#endif
   TCL_CLOSE2PROC,        /* Close proc. */
   CepInputProc,          /* Input proc. */
   CepOutputProc,         /* Output proc. */
@@ -330,6 +642,10 @@ static Tcl_ChannelType cepChannelType = {
   CepBlockModeProc,      /* Set blocking or non-blocking mode.*/
   NULL,                  /* flush proc. */
   NULL,                  /* handler proc. */
+#ifdef TCL_CHANNEL_VERSION_4
+  NULL,                  /* wide seek proc. */
+  CepThreadActionProc,   /* thread action proc. */
+#endif
 };
 
 
@@ -553,6 +869,33 @@ WaitForConnect (statePtr, errorCodePtr)
   int state;			/* Of calling TclWaitForFile. */
   int flags;			/* fcntl flags for the cep. */
 
+#ifdef CEP_ASYNC_RESOLVE
+  /*
+   * The connect can't even be started before the host name has been
+   * looked up.
+   */
+
+  if (statePtr->flags & CEP_RESOLVING) {
+    CepResolve *resolvePtr = statePtr->resolvePtr;
+    if (statePtr->flags & CEP_ASYNC_CEP) {
+      Tcl_SetErrno(EWOULDBLOCK);
+      *errorCodePtr = EWOULDBLOCK;
+      return -1;
+    }
+    Tcl_MutexLock(&resolveMutex);
+    while (!resolvePtr->done) {
+      Tcl_ConditionWait(&resolvePtr->cond, &resolveMutex, NULL);
+    }
+    Tcl_MutexUnlock(&resolveMutex);
+    FinishResolve(statePtr);
+  }
+#endif
+  if (statePtr->connectError != 0) {
+    Tcl_SetErrno(statePtr->connectError);
+    *errorCodePtr = statePtr->connectError;
+    return -1;
+  }
+
   /*
    * If an asynchronous connect is in progress, attempt to wait for it
    * to complete before reading.
@@ -618,6 +961,30 @@ CepBlockModeProc (instanceData, mode)
   CepState *statePtr = (CepState *) instanceData;
   int setting;
 
+  /*
+   * The fd of a server cep is always non-blocking so that CepAccept
+   * can drain the backlog. Its blocking mode is the one given to the
+   * ceps it accepts.
+   */
+
+  if (statePtr->flags & CEP_SERVER_CEP) {
+    if (mode == TCL_MODE_BLOCKING) {
+      statePtr->flags &= (~(CEP_ASYNC_CEP));
+    } else {
+      statePtr->flags |= CEP_ASYNC_CEP;
+    }
+    return 0;
+  }
+
+  /*
+   * Ceps accepted by accept4() with SOCK_NONBLOCK are non-blocking
+   * already.
+   */
+
+  if ((mode == TCL_MODE_NONBLOCKING) && (statePtr->flags & CEP_ASYNC_CEP)) {
+    return 0;
+  }
+
 #ifndef USE_FIONBIO
   setting = fcntl(statePtr->fd, F_GETFL);
   if (mode == TCL_MODE_BLOCKING) {
@@ -677,11 +1044,33 @@ CepInputProc (instanceData, buf, bufSize, errorCodePtr)
   int bytesRead, state;
 
   *errorCodePtr = 0;
+  if (statePtr->readerPtr != NULL) {
+    /*
+     * The D-Bus reader thread owns the input side.
+     */
+
+    *errorCodePtr = EBUSY;
+    return -1;
+  }
   state = WaitForConnect(statePtr, errorCodePtr);
   if (state != 0) {
     return -1;
   }
 
+#ifdef MSG_TRUNC
+  if (MASK2TYPE(statePtr->flags) == CEP_SEQPACKET) {
+    /*
+     * A packet is read whole or not at all: the rest of one
+     * which doesn't fit into the buffer would be silently lost.
+     */
+
+    bytesRead = recv(statePtr->fd, buf, (size_t) bufSize, MSG_TRUNC);
+    if (bytesRead > bufSize) {
+      *errorCodePtr = EMSGSIZE;
+      return -1;
+    }
+  } else
+#endif
   bytesRead = recvfrom(statePtr->fd, buf, (size_t) bufSize, 0, NULL, 0);
 
   if (bytesRead > -1) {
@@ -724,6 +1113,15 @@ CepWatchProc (instanceData, mask)
 {
   CepState *statePtr = (CepState *) instanceData;
 
+  /*
+   * Readability is up to the D-Bus reader thread while it runs.
+   */
+
+  statePtr->interest = mask;
+  if (statePtr->readerPtr != NULL) {
+    mask &= (~(TCL_READABLE));
+  }
+
   /*
    * Make sure we don't mess with server ceps since they will never
    * be readable or writable at the Tcl level.  This keeps Tcl scripts
@@ -731,6 +1129,28 @@ CepWatchProc (instanceData, mask)
    */
 
   if (statePtr->acceptProc == NULL) {
+#ifdef CEP_ASYNC_RESOLVE
+    /*
+     * There's nothing to watch before the connect has been started;
+     * FinishResolve sets up the notifier then.
+     */
+    if (statePtr->flags & CEP_RESOLVING) {
+      statePtr->resolvePtr->mask = mask;
+      return;
+    }
+#endif
+#ifdef CEP_HAVE_EPOLL
+    if (statePtr->flags & CEP_EPOLL_WATCH) {
+      if (EpollWatch(statePtr, mask) == 0) {
+	return;
+      }
+      /*
+       * epoll refused the fd; fall back to the Tcl notifier for good.
+       */
+      (void) EpollWatch(statePtr, 0);
+      statePtr->flags &= ~CEP_EPOLL_WATCH;
+    }
+#endif
     if (mask) {
       Tcl_CreateFileHandler(statePtr->fd, mask,
 			    (Tcl_FileProc *) Tcl_NotifyChannel,
@@ -741,6 +1161,73 @@ CepWatchProc (instanceData, mask)
   }
 }
 
+#ifdef TCL_CHANNEL_VERSION_4
+/*
+ *----------------------------------------------------------------------
+ *
+ * CepThreadActionProc --
+ *
+ *	Called when a cep is moved from one thread to another (with
+ *	thread::transfer, say): hands it over from the notifier of
+ *	the thread it leaves to that of the thread it joins.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A host lookup in progress is waited for and a D-Bus reader
+ *	is stopped, putting the data it holds back into the channel.
+ *	Server and receiver ceps keep accepting in the thread (and
+ *	interpreter) they were created in, like Tcl's server sockets.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CepThreadActionProc (instanceData, action)
+     ClientData instanceData;		/* The cep state. */
+     int action;			/* TCL_CHANNEL_THREAD_INSERT or
+					 * TCL_CHANNEL_THREAD_REMOVE. */
+{
+  CepState *statePtr = (CepState *) instanceData;
+
+  if (action == TCL_CHANNEL_THREAD_REMOVE) {
+#ifdef CEP_ASYNC_RESOLVE
+    /*
+     * The outcome of the lookup is reported to this thread.
+     */
+
+    if (statePtr->flags & CEP_RESOLVING) {
+      CepResolve *resolvePtr = statePtr->resolvePtr;
+      Tcl_MutexLock(&resolveMutex);
+      while (!resolvePtr->done) {
+	Tcl_ConditionWait(&resolvePtr->cond, &resolveMutex, NULL);
+      }
+      Tcl_MutexUnlock(&resolveMutex);
+      FinishResolve(statePtr);
+    }
+#endif
+#ifdef CEP_DBUS_READER
+    if (statePtr->readerPtr != NULL) {
+      StopReader(statePtr, 1);
+    }
+#endif
+#ifdef CEP_HAVE_EPOLL
+    if (statePtr->flags & CEP_EPOLL_WATCH) {
+      (void) EpollWatch(statePtr, 0);
+      statePtr->flags &= ~CEP_EPOLL_WATCH;
+    }
+#endif
+    if (statePtr->acceptProc == NULL) {
+      Tcl_DeleteFileHandler(statePtr->fd);
+    }
+  } else if ((statePtr->acceptProc == NULL) &&
+	     GetThreadSpecificData()->useEpoll && (statePtr->watchMask == 0)) {
+    statePtr->flags |= CEP_EPOLL_WATCH;
+  }
+}
+#endif
+
 /*
  *----------------------------------------------------------------------
  *
@@ -851,18 +1338,43 @@ CepCloseProc (instanceData, interp, flags)
    */
 
   if (flags == 0) {
+#ifdef CEP_DBUS_READER
+    if (statePtr->readerPtr != NULL) {
+      StopReader(statePtr, 0);
+    }
+#endif
+#ifdef CEP_HAVE_EPOLL
+    if (statePtr->flags & CEP_EPOLL_WATCH) {
+      (void) EpollWatch(statePtr, 0);
+    }
+#endif
     Tcl_DeleteFileHandler(statePtr->fd);
+#ifdef CEP_ASYNC_RESOLVE
+    if (statePtr->resolvePtr != NULL) {
+      DetachResolve(statePtr);
+    }
+#endif
     if ((statePtr->flags & CEP_SERVER_CEP) && (MASK2DOMAIN(statePtr->flags) == CEP_LOCAL)) {
       struct sockaddr_un sockaddr;
       socklen_t socklen = sizeof(struct sockaddr_un);
-      if (getsockname(statePtr->fd, (struct sockaddr *) &sockaddr, &socklen) == 0) {
+      if (getsockname(statePtr->fd, (struct sockaddr *) &sockaddr, &socklen) == 0
+	  && sockaddr.sun_path[0] != '\0') {
 	unlink(sockaddr.sun_path);
       }
     }
     if (close(statePtr->fd) < 0) {
       errorCode = Tcl_GetErrno();
     }
-    ckfree((char *) statePtr);
+    /*
+     * CepAccept may still hold the state of a server cep closed
+     * from the accept callback.
+     */
+    statePtr->fd = -1;
+    if (statePtr->recvBufs != NULL) {
+      ckfree((char *) statePtr->recvBufs);
+      statePtr->recvBufs = NULL;
+    }
+    Tcl_EventuallyFree((ClientData) statePtr, TCL_DYNAMIC);
   }
 
   return errorCode;
@@ -909,6 +1421,102 @@ CepSetOptionProc (instanceData, interp, optionName, value)
   len = strlen(optionName);
 
 
+  /*
+   * Option -acceptbatch n
+   */
+  if ((len > 1) && (optionName[1] == 'a') &&
+      (strncmp(optionName, "-acceptbatch", len) == 0)) {
+    if (Tcl_GetInt(interp, value, &optionInt) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (!(statePtr->flags & CEP_SERVER_CEP) || (optionInt < 1)) {
+      Tcl_SetErrno(EINVAL);
+      return qseterrpx("can't set acceptbatch: ");
+    }
+    statePtr->acceptBatch = optionInt;
+    return TCL_OK;
+  }
+
+  /*
+   * Option -recvbatch n
+   */
+  if ((len > 1) && (optionName[1] == 'r') &&
+      (strncmp(optionName, "-recvbatch", len) == 0)) {
+    if (Tcl_GetInt(interp, value, &optionInt) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (!(statePtr->flags & CEP_RECEIVER_CEP) || (optionInt < 1) || (optionInt > CEP_RECV_BATCH_MAX)) {
+      Tcl_SetErrno(EINVAL);
+      return qseterrpx("can't set recvbatch: ");
+    }
+    if (optionInt != statePtr->recvBatch && statePtr->recvBufs != NULL) {
+      ckfree((char *) statePtr->recvBufs);
+      statePtr->recvBufs = NULL;
+    }
+    statePtr->recvBatch = optionInt;
+    return TCL_OK;
+  }
+
+  /*
+   * Option -sendbuffer n and -receivebuffer n
+   */
+  if ((len > 1) && ((optionName[1] == 's') || (optionName[1] == 'r')) &&
+      ((strncmp(optionName, "-sendbuffer", len) == 0) || (strncmp(optionName, "-receivebuffer", len) == 0))) {
+    int send = (optionName[1] == 's');
+    if (Tcl_GetInt(interp, value, &optionInt) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (optionInt < 1) {
+      Tcl_SetErrno(EINVAL);
+      return qseterrpx(send ? "can't set sendbuffer: " : "can't set receivebuffer: ");
+    }
+    socklen = sizeof(optionInt);
+    if (setsockopt(statePtr->fd, SOL_SOCKET, (send ? SO_SNDBUF : SO_RCVBUF), (char *) &optionInt, socklen) < 0) {
+      return qseterrpx(send ? "can't set sendbuffer: " : "can't set receivebuffer: ");
+    }
+    return TCL_OK;
+  }
+
+  /*
+   * Option -nodelay boolean
+   */
+  if ((len > 1) && (optionName[1] == 'n') &&
+      (strncmp(optionName, "-nodelay", len) == 0)) {
+    if (Tcl_GetBoolean(interp, value, &optionInt) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (!CEP_IS_TCP(cepDomain, cepType)) {
+      Tcl_SetErrno(EINVAL);
+      return qseterrpx("can't set nodelay: ");
+    }
+    socklen = sizeof(optionInt);
+    if (setsockopt(statePtr->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &optionInt, socklen) < 0) {
+      return qseterrpx("can't set nodelay: ");
+    }
+    return TCL_OK;
+  }
+
+#ifdef CEP_TCP_CORK
+  /*
+   * Option -cork boolean
+   */
+  if ((len > 1) && (optionName[1] == 'c') &&
+      (strncmp(optionName, "-cork", len) == 0)) {
+    if (Tcl_GetBoolean(interp, value, &optionInt) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (!CEP_IS_TCP(cepDomain, cepType)) {
+      Tcl_SetErrno(EINVAL);
+      return qseterrpx("can't set cork: ");
+    }
+    socklen = sizeof(optionInt);
+    if (setsockopt(statePtr->fd, IPPROTO_TCP, CEP_TCP_CORK, (char *) &optionInt, socklen) < 0) {
+      return qseterrpx("can't set cork: ");
+    }
+    return TCL_OK;
+  }
+#endif
+
   /*
    * Option -broadcast boolean
    */
@@ -1247,13 +1855,13 @@ CepSetOptionProc (instanceData, interp, optionName, value)
 	((struct sockaddr_in *) &sockaddr)->sin_family = AF_UNSPEC;
 	/*	((struct sockaddr_in *) &sockaddr)->sin_len = GetSocketStructSize(cepDomain);*/
       }
+      socklen = GetSocketStructSize(cepDomain);
     } else {
-      if (CreateCepAddress(cepDomain, &sockaddr, argv[0], optionInt, resolve) != 0) {
+      if (CreateCepAddress(cepDomain, &sockaddr, &socklen, argv[0], optionInt, resolve) != 0) {
 	ckfree((char *) argv);
 	return qseterrpx("can't set peername: ");
       }
     }
-    socklen = GetSocketStructSize(cepDomain);
     if ((connect(statePtr->fd, (struct sockaddr *) &sockaddr, socklen) < 0) && (Tcl_GetErrno() != EAFNOSUPPORT)) {
       ckfree((char *) argv);
       return qseterrpx("can't set peername: ");
@@ -1262,7 +1870,7 @@ CepSetOptionProc (instanceData, interp, optionName, value)
     return TCL_OK;
   }
 
-  return Tcl_BadChannelOption(interp, optionName, "broadcast header hops join leave loop maddr mhops peername resolve route shutdown");
+  return Tcl_BadChannelOption(interp, optionName, "acceptbatch broadcast cork header hops join leave loop maddr mhops nodelay peername receivebuffer recvbatch resolve route sendbuffer shutdown");
 }
 
 /*
@@ -1329,6 +1937,9 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
     if (ret != 0) {
       err = Tcl_GetErrno();
     }
+    if (statePtr->connectError != 0) {
+      err = statePtr->connectError;
+    }
     if (err != 0) {
       Tcl_DStringAppend(dsPtr, Tcl_ErrnoMsg(err), -1);
     }
@@ -1336,20 +1947,57 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
   }
 
   /*
-   * Option -peername
+   * Option -acceptbatch
    */
-  if ((len == 0) ||
-      ((len > 1) && (optionName[1] == 'p') &&
-       (strncmp(optionName, "-peername", len) == 0))) {
-    socklen = sizeof(struct sockaddr_storage);
+  if ((statePtr->flags & CEP_SERVER_CEP) &&
+      ((len == 0) ||
+       ((len > 1) && (optionName[1] == 'a') &&
+	(strncmp(optionName, "-acceptbatch", len) == 0)))) {
+    if (len == 0) {
+      Tcl_DStringAppendElement(dsPtr, "-acceptbatch");
+    }
+    (void) snprintf(optionVal, TCL_INTEGER_SPACE, "%d", statePtr->acceptBatch);
+    Tcl_DStringAppendElement(dsPtr, optionVal);
+    if (len > 0) {
+      return TCL_OK;
+    }
+  }
+
+  /*
+   * Option -recvbatch
+   */
+  if ((statePtr->flags & CEP_RECEIVER_CEP) &&
+      ((len == 0) ||
+       ((len > 1) && (optionName[1] == 'r') &&
+	(strncmp(optionName, "-recvbatch", len) == 0)))) {
+    if (len == 0) {
+      Tcl_DStringAppendElement(dsPtr, "-recvbatch");
+    }
+    (void) snprintf(optionVal, TCL_INTEGER_SPACE, "%d", statePtr->recvBatch);
+    Tcl_DStringAppendElement(dsPtr, optionVal);
+    if (len > 0) {
+      return TCL_OK;
+    }
+  }
+
+  /*
+   * Option -peername
+   */
+  if ((len == 0) ||
+      ((len > 1) && (optionName[1] == 'p') &&
+       (strncmp(optionName, "-peername", len) == 0))) {
+    socklen = sizeof(struct sockaddr_storage);
     if (getpeername(statePtr->fd, (struct sockaddr *) &sockaddr, &socklen) == 0) {
       if (len == 0) {
 	Tcl_DStringAppendElement(dsPtr, "-peername");
 	Tcl_DStringStartSublist(dsPtr);
       }
       if (sap->sa_family == AF_LOCAL) {
-	Tcl_DStringAppendElement(dsPtr, slp->sun_path);
-	Tcl_DStringAppendElement(dsPtr, slp->sun_path);
+	Tcl_DString ds;
+	LocalAddressToUtf(slp, socklen, &ds);
+	Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
+	Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
+	Tcl_DStringFree(&ds);
 	(void) snprintf(optionVal, TCL_INTEGER_SPACE, "%u", socklen);
 	Tcl_DStringAppendElement(dsPtr, optionVal);
       } else {
@@ -1426,8 +2074,11 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
 	Tcl_DStringStartSublist(dsPtr);
       }
       if (sap->sa_family == AF_LOCAL) {
-	Tcl_DStringAppendElement(dsPtr, slp->sun_path);
-	Tcl_DStringAppendElement(dsPtr, slp->sun_path);
+	Tcl_DString ds;
+	LocalAddressToUtf(slp, socklen, &ds);
+	Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
+	Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
+	Tcl_DStringFree(&ds);
 	(void) snprintf(optionVal, TCL_INTEGER_SPACE, "%u", socklen);
 	Tcl_DStringAppendElement(dsPtr, optionVal);
       } else {
@@ -1521,6 +2172,79 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
     }
   }
 
+  /*
+   * Option -sendbuffer and -receivebuffer
+   */
+  if ((len == 0) ||
+      ((len > 1) && ((optionName[1] == 's') || (optionName[1] == 'r')) &&
+       ((strncmp(optionName, "-sendbuffer", len) == 0) || (strncmp(optionName, "-receivebuffer", len) == 0)))) {
+    int send;
+    for (send = 1; send >= 0; send--) {
+      if ((len > 0) && (send != (optionName[1] == 's'))) {
+	continue;
+      }
+      optionInt = 0;
+      socklen = sizeof(optionInt);
+      if (getsockopt(statePtr->fd, SOL_SOCKET, (send ? SO_SNDBUF : SO_RCVBUF), (char *) &optionInt, &socklen) != 0) {
+	return qseterrpx(send ? "can't get sendbuffer: " : "can't get receivebuffer: ");
+      }
+      if (len == 0) {
+	Tcl_DStringAppendElement(dsPtr, (send ? "-sendbuffer" : "-receivebuffer"));
+      }
+      (void) snprintf(optionVal, TCL_INTEGER_SPACE, "%d", optionInt);
+      Tcl_DStringAppendElement(dsPtr, optionVal);
+    }
+    if (len > 0) {
+      return TCL_OK;
+    }
+  }
+
+  /*
+   * Option -nodelay
+   */
+  if (CEP_IS_TCP(cepDomain, cepType) &&
+      ((len == 0) ||
+       ((len > 1) && (optionName[1] == 'n') &&
+	(strncmp(optionName, "-nodelay", len) == 0)))) {
+    optionInt = 0;
+    socklen = sizeof(optionInt);
+    if (getsockopt(statePtr->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &optionInt, &socklen) != 0) {
+      return qseterrpx("can't get nodelay: ");
+    }
+    if (len == 0) {
+      Tcl_DStringAppendElement(dsPtr, "-nodelay");
+    }
+    (void) snprintf(optionVal, TCL_INTEGER_SPACE, "%d", (optionInt != 0));
+    Tcl_DStringAppendElement(dsPtr, optionVal);
+    if (len > 0) {
+      return TCL_OK;
+    }
+  }
+
+#ifdef CEP_TCP_CORK
+  /*
+   * Option -cork
+   */
+  if (CEP_IS_TCP(cepDomain, cepType) &&
+      ((len == 0) ||
+       ((len > 1) && (optionName[1] == 'c') &&
+	(strncmp(optionName, "-cork", len) == 0)))) {
+    optionInt = 0;
+    socklen = sizeof(optionInt);
+    if (getsockopt(statePtr->fd, IPPROTO_TCP, CEP_TCP_CORK, (char *) &optionInt, &socklen) != 0) {
+      return qseterrpx("can't get cork: ");
+    }
+    if (len == 0) {
+      Tcl_DStringAppendElement(dsPtr, "-cork");
+    }
+    (void) snprintf(optionVal, TCL_INTEGER_SPACE, "%d", (optionInt != 0));
+    Tcl_DStringAppendElement(dsPtr, optionVal);
+    if (len > 0) {
+      return TCL_OK;
+    }
+  }
+#endif
+
   /*
    * Option -domain
    */
@@ -1568,6 +2292,9 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
     case CEP_DGRAM:
       typePtr = "datagram";
       break;
+    case CEP_SEQPACKET:
+      typePtr = "seqpacket";
+      break;
     case CEP_RAW:
       typePtr = "raw";
       break;
@@ -1749,12 +2476,10 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
     if (statePtr->protocol == 0) {
       Tcl_DStringAppendElement(dsPtr, "default");
     } else {
-      struct protoent *pe = getprotobynumber(statePtr->protocol);
-      if (pe == NULL) {
+      Tcl_DString ds;
+      if (!GetProtocolName(statePtr->protocol, &ds)) {
 	return qseterrpx("can't get protocol: ");
       } else {
-	Tcl_DString ds;
-	Tcl_ExternalToUtfDString(NULL, pe->p_name, -1, &ds);
 	Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
 	Tcl_DStringFree(&ds);
       }
@@ -1930,7 +2655,7 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
   }
 
   if (len > 0) {
-    return Tcl_BadChannelOption(interp, optionName, "broadcast domain header hops maddr mhops resolve loop peereid peername protocol resolve route shutdown sockname type");
+    return Tcl_BadChannelOption(interp, optionName, "acceptbatch broadcast cork domain header hops maddr mhops nodelay resolve loop peereid peername protocol receivebuffer recvbatch resolve route sendbuffer shutdown sockname type");
   }
 
   return TCL_OK;
@@ -1942,6 +2667,10 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
  * CreateCepAddress --
  *
  *	This function initializes a sockaddr structure for a host and port.
+ *	For local ceps, a host starting with a NUL character denotes
+ *	an address in the Linux abstract namespace; such addresses are
+ *	not NUL-terminated, so their length must be passed along with
+ *	the sockaddr structure.
  *
  * Results:
  *	0 on success, -1 on error
@@ -1954,9 +2683,11 @@ CepGetOptionProc (instanceData, interp, optionName, dsPtr)
  */
 
 static int
-CreateCepAddress (cepDomain, sockaddrPtr, host, port, resolve)
+CreateCepAddress (cepDomain, sockaddrPtr, sizePtr, host, port, resolve)
      int cepDomain;
      struct sockaddr_storage *sockaddrPtr;	/* Socket address */
+     socklen_t *sizePtr;		/* Where to store the length of
+					 * the address; can be NULL. */
      const char *host;			/* Host.  NULL implies INADDR_ANY */
      int port;				/* Port number */
      int resolve;
@@ -1975,13 +2706,30 @@ CreateCepAddress (cepDomain, sockaddrPtr, host, port, resolve)
 
   port = htons((unsigned short) (port & 0xFFFF));
   sap->sa_family = CepDomainToSysDomain(cepDomain);
+  if (sizePtr != NULL) {
+    *sizePtr = GetSocketStructSize(cepDomain);
+  }
 
   if (cepDomain == CEP_LOCAL) {
     if (host != NULL) {
       Tcl_DString ds;
       const char *native;
+      int len;
       native = Tcl_UtfToExternalDString(NULL, host, -1, &ds);
-      strlcpy(slp->sun_path, native, sizeof(slp->sun_path));
+      len = Tcl_DStringLength(&ds);
+      if (len > 0 && native[0] == '\0') {
+	if ((size_t) len > sizeof(slp->sun_path)) {
+	  Tcl_DStringFree(&ds);
+	  Tcl_SetErrno(ENAMETOOLONG);
+	  return -1;
+	}
+	memcpy(slp->sun_path, native, (size_t) len);
+	if (sizePtr != NULL) {
+	  *sizePtr = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + (size_t) len);
+	}
+      } else {
+	strlcpy(slp->sun_path, native, sizeof(slp->sun_path));
+      }
       Tcl_DStringFree(&ds);
       return 0;
     }
@@ -2028,6 +2776,43 @@ CreateCepAddress (cepDomain, sockaddrPtr, host, port, resolve)
   return 0;	/* Success. */
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalAddressToUtf --
+ *
+ *	Converts the path of a local cep address of the given size
+ *	to UTF-8. Addresses in the Linux abstract namespace keep
+ *	their leading NUL character.
+ *
+ * Results:
+ *	The converted address.
+ *
+ * Side effects:
+ *	Initializes *dsPtr, which the caller must free.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+LocalAddressToUtf (slp, size, dsPtr)
+     struct sockaddr_un *slp;
+     socklen_t size;
+     Tcl_DString *dsPtr;
+{
+  size_t offset = offsetof(struct sockaddr_un, sun_path);
+  int len = -1;
+
+  if (size <= offset) {
+    len = 0;
+  } else if (slp->sun_path[0] == '\0') {
+    len = (int) (size - offset);
+  } else if (size < sizeof(struct sockaddr_un)) {
+    len = (int) strnlen(slp->sun_path, size - offset);
+  }
+  return Tcl_ExternalToUtfDString(NULL, slp->sun_path, len, dsPtr);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2078,6 +2863,9 @@ CreateCep (interp, cepDomain, cepType, protocol, host, port, server, myaddr, myp
   int domain;
   int type;
   int proto = 0;
+  const char *resolveHost = NULL;	/* Host to look up on a worker
+					 * thread, if any. */
+  int cached = 0;			/* Address found in the cache? */
 
   sock = -1;
   origState = 0;
@@ -2087,30 +2875,40 @@ CreateCep (interp, cepDomain, cepType, protocol, host, port, server, myaddr, myp
   size = GetSocketStructSize(cepDomain);
 
   if (!((host == NULL) && (port == -1))) {
-    if (CreateCepAddress(cepDomain, &sockaddr, host, port, resolve) != 0) {
+#ifdef CEP_ASYNC_RESOLVE
+    /*
+     * Don't hold the interpreter up while looking up the host
+     * of an asynchronous client cep, unless it's a numeric address
+     * or has been looked up recently.
+     */
+    if (async && !server && resolve && (host != NULL) &&
+	((cepDomain == CEP_INET) || (cepDomain == CEP_INET6))) {
+      struct in6_addr addr;
+      if (inet_pton(domain, host, &addr) != 1) {
+	cached = ResolveCacheLookup(domain, host, port, &sockaddr, &size);
+	if (!cached) {
+	  resolveHost = host;
+	}
+      }
+    }
+#endif
+    if ((resolveHost == NULL) && !cached &&
+	(CreateCepAddress(cepDomain, &sockaddr, &size, host, port, resolve) != 0)) {
       goto addressError;
     }
   }
 
   if (cepDomain != CEP_LOCAL && (myaddr != NULL || myport != 0)) {
-    if (CreateCepAddress(cepDomain, &mysockaddr, myaddr, myport, resolve) != 0) {
+    if (CreateCepAddress(cepDomain, &mysockaddr, NULL, myaddr, myport, resolve) != 0) {
       goto addressError;
     }
   }
 
   if ((protocol != NULL) && (strlen(protocol) > 0) && (strcmp(protocol, "default") != 0)) {
     if (Tcl_GetInt(interp, protocol, &proto) != TCL_OK) {
-      Tcl_DString ds;
-      const char *native;
-      struct protoent *pe;
-
-      native = Tcl_UtfToExternalDString(NULL, protocol, -1, &ds);
-      pe = getprotobyname(native);
-      Tcl_DStringFree(&ds);
-      if (pe == NULL) {
+      if (!GetProtocolNumber(protocol, &proto)) {
 	goto addressError;
       } 
-      proto = pe->p_proto;
     }
   }
 
@@ -2153,7 +2951,7 @@ CreateCep (interp, cepDomain, cepType, protocol, host, port, server, myaddr, myp
 
     status = bind(sock, (struct sockaddr *) &sockaddr, size);
 
-    if (cepType == CEP_STREAM) {
+    if (cepType == CEP_STREAM || cepType == CEP_SEQPACKET) {
       if (status != -1) {
 	status = listen(sock, SOMAXCONN);
       }
@@ -2200,7 +2998,12 @@ CreateCep (interp, cepDomain, cepType, protocol, host, port, server, myaddr, myp
       } else {
 	status = 0;
       }
-      if (status >= 0) {
+      if ((status >= 0) && (resolveHost != NULL)) {
+	/*
+	 * FinishResolve will connect once the host has been looked up.
+	 */
+	asyncConnect = 1;
+      } else if (status >= 0) {
 	status = connect(sock, (struct sockaddr *) &sockaddr, size);
 	if (status < 0) {
 	  if (Tcl_GetErrno() == EINPROGRESS) {
@@ -2257,7 +3060,32 @@ CreateCep (interp, cepDomain, cepType, protocol, host, port, server, myaddr, myp
   if (resolve) {
     statePtr->flags |= CEP_RESOLVE_NAMES;
   }
+  if (GetThreadSpecificData()->useEpoll) {
+    statePtr->flags |= CEP_EPOLL_WATCH;
+  }
   statePtr->protocol = proto;
+  statePtr->watchMask = 0;
+  statePtr->acceptBatch = CEP_ACCEPT_BATCH;
+  statePtr->recvBatch = CEP_RECV_BATCH;
+  statePtr->recvBufs = NULL;
+  statePtr->resolvePtr = NULL;
+  statePtr->connectError = 0;
+  statePtr->interest = 0;
+  statePtr->readerPtr = NULL;
+
+#ifdef CEP_ASYNC_RESOLVE
+  if (resolveHost != NULL) {
+    statePtr->resolvePtr = StartResolve(statePtr, domain, type, resolveHost, port);
+    if (statePtr->resolvePtr == NULL) {
+      ckfree((char *) statePtr);
+      close(sock);
+      Tcl_SetErrno(EAGAIN);
+      qseterrpx("couldn't open cep: ");
+      return NULL;
+    }
+    statePtr->flags |= CEP_RESOLVING;
+  }
+#endif
 
   return statePtr;
 
@@ -2355,7 +3183,18 @@ MakeCepClientChannelMode (sock, cepDomain, cepType, protocol, resolve, mode)
   if (resolve) {
     statePtr->flags |= CEP_RESOLVE_NAMES;
   }
+  if (GetThreadSpecificData()->useEpoll) {
+    statePtr->flags |= CEP_EPOLL_WATCH;
+  }
   statePtr->protocol = protocol;
+  statePtr->watchMask = 0;
+  statePtr->acceptBatch = CEP_ACCEPT_BATCH;
+  statePtr->recvBatch = CEP_RECV_BATCH;
+  statePtr->recvBufs = NULL;
+  statePtr->resolvePtr = NULL;
+  statePtr->connectError = 0;
+  statePtr->interest = 0;
+  statePtr->readerPtr = NULL;
   statePtr->acceptProc = NULL;
   statePtr->acceptProcData = (ClientData) NULL;
 
@@ -2400,18 +3239,10 @@ Cep_OpenLocalPair (interp, cepDomain, cepType, protocol, chan1, chan2)
 
   if ((protocol != NULL) && (strlen(protocol) > 0) && (strcmp(protocol, "default") != 0)) {
     if (Tcl_GetInt(interp, protocol, &proto) != TCL_OK) {
-      Tcl_DString ds;
-      const char *native;
-      struct protoent *pe;
-
-      native = Tcl_UtfToExternalDString(NULL, protocol, -1, &ds);
-      pe = getprotobyname(native);
-      Tcl_DStringFree(&ds);
-      if (pe == NULL) {
+      if (!GetProtocolNumber(protocol, &proto)) {
 	qseterrpx("couldn't create localpair: ");
 	return -1;
       } 
-      proto = pe->p_proto;
     }
   }
 
@@ -2552,6 +3383,19 @@ Cep_OpenServer (interp, receiver, cepDomain, cepType, protocol, myAddr, port, re
   statePtr->acceptProc = acceptProc;
   statePtr->acceptProcData = acceptProcData;
 
+  if (receiver) {
+    statePtr->flags |= CEP_RECEIVER_CEP;
+  } else {
+    int setting;
+#ifndef USE_FIONBIO
+    setting = fcntl(statePtr->fd, F_GETFL);
+    (void) fcntl(statePtr->fd, F_SETFL, setting | O_NONBLOCK);
+#else /* USE_FIONBIO */
+    setting = 1;
+    (void) ioctl(statePtr->fd, (int) FIONBIO, &setting);
+#endif /* !USE_FIONBIO */
+  }
+
   /*
    * Set up the callback mechanism for accepting connections
    * from new clients.
@@ -2574,14 +3418,19 @@ Cep_OpenServer (interp, receiver, cepDomain, cepType, protocol, myAddr, port, re
  *----------------------------------------------------------------------
  *
  * CepAccept --
- *	Accept a CEP socket connection.	 This is called by the event loop.
+ *	Accept CEP socket connections.	 This is called by the event loop.
+ *
+ *	Up to -acceptbatch connections are taken from the backlog per
+ *	call. Where available, accept4() is used to make accepted ceps
+ *	close-on-exec and, if the server cep is non-blocking,
+ *	non-blocking without extra system calls.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Creates a new connection socket. Calls the registered callback
- *	for the connection acceptance mechanism.
+ *	Creates new connection sockets. Calls the registered callback
+ *	for the connection acceptance mechanism for each of them.
  *
  *----------------------------------------------------------------------
  */
@@ -2594,102 +3443,211 @@ CepAccept (data, mask)
   CepState *statePtr = (CepState *) data;		/* Client data of server socket. */
   CepState *newCepState;		/* State for new socket. */
   struct sockaddr_storage sockaddr;		/* The remote address */
-  socklen_t size = sizeof(struct sockaddr_storage);
+  socklen_t size;
   int newsock;			/* The new client socket */
   char channelName[CEP_CHANNELNAME_MAX];
   int cepDomain;
+  int async;			/* Accepted ceps are non-blocking. */
+  unsigned int asyncFlags;	/* Flags of ceps already non-blocking. */
+  int count;
 
 
-  newsock = accept(statePtr->fd, (struct sockaddr *) &sockaddr, &size);
-  if (newsock < 0) {
-    return;
-  }
+  cepDomain = MASK2DOMAIN(statePtr->flags);
+  async = (statePtr->flags & CEP_ASYNC_CEP);
 
   /*
-   * Set close-on-exec flag to prevent the newly accepted socket from
-   * being inherited by child processes.
+   * The accept callback may close the server cep.
    */
 
-  (void) fcntl(newsock, F_SETFD, FD_CLOEXEC);
+  Tcl_Preserve((ClientData) statePtr);
 
-  newCepState = (CepState *) ckalloc((unsigned) sizeof(CepState));
+  for (count = 0; (count < statePtr->acceptBatch) && (statePtr->fd != -1); count++) {
+    size = sizeof(struct sockaddr_storage);
 
-  cepDomain = MASK2DOMAIN(statePtr->flags);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    newsock = accept4(statePtr->fd, (struct sockaddr *) &sockaddr, &size,
+		      SOCK_CLOEXEC | (async ? SOCK_NONBLOCK : 0));
+    asyncFlags = async ? CEP_ASYNC_CEP : 0;
+#else
+    newsock = accept(statePtr->fd, (struct sockaddr *) &sockaddr, &size);
+    asyncFlags = 0;
+#endif
+    if (newsock < 0) {
+      break;
+    }
 
-  newCepState->flags = 0;
-  newCepState->flags |= DOMAIN2MASK(cepDomain);
-  newCepState->flags |= TYPE2MASK(MASK2TYPE(statePtr->flags));
-  if (statePtr->flags & CEP_RESOLVE_NAMES) {
-    newCepState->flags |= CEP_RESOLVE_NAMES;
-  }
-  newCepState->protocol = statePtr->protocol;
-  newCepState->fd = newsock;
-  newCepState->acceptProc = NULL;
-  newCepState->acceptProcData = NULL;
-
-  (void) snprintf(channelName, CEP_CHANNELNAME_MAX, "cep%d", newsock);
-
-  newCepState->channel = Tcl_CreateChannel(&cepChannelType, channelName,
-					   (ClientData) newCepState, (TCL_READABLE | TCL_WRITABLE));
-
-  Tcl_SetChannelOption(NULL, newCepState->channel, "-translation", "auto crlf");
-
-  if (statePtr->acceptProc != NULL) {
-    struct sockaddr_in6 *s6p = (struct sockaddr_in6 *) &sockaddr;
-    struct sockaddr_in  *s4p = (struct sockaddr_in  *) &sockaddr;
-    struct sockaddr_un  *slp = (struct sockaddr_un  *) &sockaddr;
-    char addrBuf[CEP_HOSTNAME_MAX];
-    int port = -1;
-    uid_t euid = (unsigned) -1;
-    gid_t egid = (unsigned) -1; 
-    char *addrPtr = addrBuf;
-    Tcl_DString ds;
+#if !(defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
+    /*
+     * Set close-on-exec flag to prevent the newly accepted socket from
+     * being inherited by child processes.
+     */
 
-    Tcl_DStringInit(&ds);
+    (void) fcntl(newsock, F_SETFD, FD_CLOEXEC);
+#endif
 
-    if (cepDomain == CEP_LOCAL) {
-      /* accept() doesn't fill in sun_path? */
-      if (getsockname(newsock, (struct sockaddr *) &sockaddr, &size) != 0) {
-	addrBuf[0] = '!';
-	addrBuf[1] = '\0';
-      } else {
-	Tcl_ExternalToUtfDString(NULL, slp->sun_path, -1, &ds);
-	addrPtr = Tcl_DStringValue(&ds);
-      }
-      if (getpeereid(newsock, &euid, &egid) != 0) {
-	/* ? */
-      }
-    } else {
-      if (getnameinfo((struct sockaddr *) &sockaddr, size, addrBuf, sizeof(addrBuf), NULL, 0, NI_NUMERICHOST) != 0) {
-	addrBuf[0] = '?';
-	addrBuf[1] = '\0';
-      }
-      if (cepDomain == CEP_INET6) {
-	port = ntohs((unsigned short) s6p->sin6_port);
+    newCepState = (CepState *) ckalloc((unsigned) sizeof(CepState));
+
+    newCepState->flags = asyncFlags;
+    newCepState->flags |= DOMAIN2MASK(cepDomain);
+    newCepState->flags |= TYPE2MASK(MASK2TYPE(statePtr->flags));
+    if (statePtr->flags & CEP_RESOLVE_NAMES) {
+      newCepState->flags |= CEP_RESOLVE_NAMES;
+    }
+    if (GetThreadSpecificData()->useEpoll) {
+      newCepState->flags |= CEP_EPOLL_WATCH;
+    }
+    newCepState->protocol = statePtr->protocol;
+    newCepState->watchMask = 0;
+    newCepState->acceptBatch = CEP_ACCEPT_BATCH;
+    newCepState->recvBatch = CEP_RECV_BATCH;
+    newCepState->recvBufs = NULL;
+    newCepState->resolvePtr = NULL;
+    newCepState->connectError = 0;
+    newCepState->interest = 0;
+    newCepState->readerPtr = NULL;
+    newCepState->fd = newsock;
+    newCepState->acceptProc = NULL;
+    newCepState->acceptProcData = NULL;
+
+    (void) snprintf(channelName, CEP_CHANNELNAME_MAX, "cep%d", newsock);
+
+    newCepState->channel = Tcl_CreateChannel(&cepChannelType, channelName,
+					     (ClientData) newCepState, (TCL_READABLE | TCL_WRITABLE));
+
+    Tcl_SetChannelOption(NULL, newCepState->channel, "-translation", "auto crlf");
+    if (async) {
+      Tcl_SetChannelOption(NULL, newCepState->channel, "-blocking", "0");
+    }
+
+    if (statePtr->acceptProc != NULL) {
+      struct sockaddr_in6 *s6p = (struct sockaddr_in6 *) &sockaddr;
+      struct sockaddr_in  *s4p = (struct sockaddr_in  *) &sockaddr;
+      struct sockaddr_un  *slp = (struct sockaddr_un  *) &sockaddr;
+      char addrBuf[CEP_HOSTNAME_MAX];
+      int port = -1;
+      uid_t euid = (unsigned) -1;
+      gid_t egid = (unsigned) -1; 
+      char *addrPtr = addrBuf;
+      Tcl_DString ds;
+
+      Tcl_DStringInit(&ds);
+
+      if (cepDomain == CEP_LOCAL) {
+	/* accept() doesn't fill in sun_path? */
+	size = sizeof(struct sockaddr_storage);
+	if (getsockname(newsock, (struct sockaddr *) &sockaddr, &size) != 0) {
+	  addrBuf[0] = '!';
+	  addrBuf[1] = '\0';
+	} else {
+	  Tcl_DStringFree(&ds);
+	  addrPtr = (char *) LocalAddressToUtf(slp, size, &ds);
+	}
+	if (getpeereid(newsock, &euid, &egid) != 0) {
+	  /* ? */
+	}
       } else {
-	port = ntohs((unsigned short) s4p->sin_port);
+	if (getnameinfo((struct sockaddr *) &sockaddr, size, addrBuf, sizeof(addrBuf), NULL, 0, NI_NUMERICHOST) != 0) {
+	  addrBuf[0] = '?';
+	  addrBuf[1] = '\0';
+	}
+	if (cepDomain == CEP_INET6) {
+	  port = ntohs((unsigned short) s6p->sin6_port);
+	} else {
+	  port = ntohs((unsigned short) s4p->sin_port);
+	}
       }
-    }
 
-    (*statePtr->acceptProc)(statePtr->acceptProcData,
-			    newCepState->channel, (const char *) addrPtr, port,
-			    cepDomain, euid, egid, (const unsigned char *) NULL);
-    Tcl_DStringFree(&ds);
+      (*statePtr->acceptProc)(statePtr->acceptProcData,
+			      newCepState->channel, (const char *) addrPtr, port,
+			      cepDomain, euid, egid, (const unsigned char *) NULL);
+      Tcl_DStringFree(&ds);
+    }
   }
+
+  Tcl_Release((ClientData) statePtr);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CepReceiverListen --
+ * ReceiverDeliver --
  *
+ *	Hands a datagram received on a receiver cep, along with the
+ *	address of its sender, to the receive callback.
  *
  * Results:
- *
+ *	None.
  *
  * Side effects:
+ *	Whatever the callback does; it may close the cep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReceiverDeliver (statePtr, sockaddrPtr, size, buf, bytesRead)
+     CepState *statePtr;
+     struct sockaddr_storage *sockaddrPtr;	/* Address of the sender. */
+     socklen_t size;
+     const unsigned char *buf;
+     ssize_t bytesRead;
+{
+  struct sockaddr     *sap = (struct sockaddr     *) sockaddrPtr;
+  struct sockaddr_in6 *s6p = (struct sockaddr_in6 *) sockaddrPtr;
+  struct sockaddr_in  *s4p = (struct sockaddr_in  *) sockaddrPtr;
+  struct sockaddr_un  *slp = (struct sockaddr_un  *) sockaddrPtr;
+  char addrBuf[CEP_HOSTNAME_MAX];
+  char *addrPtr = addrBuf;
+  int cepDomain;
+  int port = -1;
+  Tcl_DString ds;
+
+  if (statePtr->acceptProc == NULL) {
+    return;
+  }
+
+  Tcl_DStringInit(&ds);
+
+  cepDomain = SysDomainToCepDomain(sap->sa_family);
+  if (cepDomain == CEP_LOCAL) {
+    addrPtr = (char *) LocalAddressToUtf(slp, size, &ds);
+  } else {
+    (void) memset(addrBuf, 0, sizeof(addrBuf));
+    if (getnameinfo((struct sockaddr *) sockaddrPtr, size, addrBuf, sizeof(addrBuf), NULL, 0, NI_NUMERICHOST) != 0) {
+      addrBuf[0] = '?';
+      addrBuf[1] = '\0';
+    }
+    if (cepDomain == CEP_INET6) {
+      port = ntohs((unsigned short) s6p->sin6_port);
+    } else {
+      port = ntohs((unsigned short) s4p->sin_port);
+    }
+  }
+
+  (*statePtr->acceptProc)(statePtr->acceptProcData,
+			  statePtr->channel, (const char *) addrPtr, port,
+			  cepDomain, (unsigned) -1, (unsigned) bytesRead, buf);
+  Tcl_DStringFree(&ds);
+}
+
+/*
+ *----------------------------------------------------------------------
  *
+ * CepReceiverListen --
+ *
+ *	Called when a receiver cep becomes readable.  Takes up to
+ *	-recvbatch datagrams waiting on the cep and delivers them one
+ *	by one to the receive callback, so that a burst of datagrams
+ *	doesn't cost a trip through the notifier each.  On Linux, inet
+ *	datagrams are fetched with a single recvmmsg() call; local ones,
+ *	which may be larger than CEP_RECV_SLOT, are sized with FIONREAD
+ *	and received one at a time.
+ *
+ * Results:
+ *	None.
  *
+ * Side effects:
+ *	Consumes datagrams; evaluates the callback.
  *
  *----------------------------------------------------------------------
  */
@@ -2701,51 +3659,85 @@ CepReceiverListen (data, mask)
 {
   CepState *statePtr = (CepState *) data;		/* Client data of server socket. */
   struct sockaddr_storage sockaddr;		/* The remote address */
-  socklen_t size = sizeof(struct sockaddr_storage);
+  socklen_t size;
   int bytesAvail;
   ssize_t bytesRead;
   unsigned char *buf;
+  int count;
 
+  /*
+   * The callback may close the receiver cep.
+   */
 
-  /* This is actually the number of bytes + header */
-  if (ioctl(statePtr->fd, FIONREAD, &bytesAvail) == -1) {
-    Tcl_Panic("CepReceiverListen ioctl FIONREAD error (%s)", Tcl_ErrnoMsg(Tcl_GetErrno()));
-  }
-  buf = (unsigned char *) ckalloc((unsigned) bytesAvail);
-  /* memset(buf, 0, (size_t) bytesAvail); */
-  bytesRead = recvfrom(statePtr->fd, buf, (size_t) bytesAvail, 0, (struct sockaddr *) &sockaddr, &size);
+  Tcl_Preserve((ClientData) statePtr);
 
-  if (statePtr->acceptProc != NULL) {
-    struct sockaddr     *sap = (struct sockaddr     *) &sockaddr;
-    struct sockaddr_in6 *s6p = (struct sockaddr_in6 *) &sockaddr;
-    struct sockaddr_in  *s4p = (struct sockaddr_in  *) &sockaddr;
-    struct sockaddr_un  *slp = (struct sockaddr_un  *) &sockaddr;
-    char addrBuf[CEP_HOSTNAME_MAX];
-    char *addrPtr = addrBuf;
-    int cepDomain;
-    int port = -1;
+#ifdef MSG_WAITFORONE
+  if (MASK2DOMAIN(statePtr->flags) != CEP_LOCAL && statePtr->recvBatch > 1) {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    unsigned char *bufs;
+    int n, i;
 
-    cepDomain = SysDomainToCepDomain(sap->sa_family);
-    if (cepDomain == CEP_LOCAL) {
-      addrPtr = slp->sun_path;
-    } else {
-      (void) memset(addrBuf, 0, sizeof(addrBuf));
-      if (getnameinfo((struct sockaddr *) &sockaddr, size, addrBuf, sizeof(addrBuf), NULL, 0, NI_NUMERICHOST) != 0) {
-	addrBuf[0] = '?';
-	addrBuf[1] = '\0';
-      }
-      if (cepDomain == CEP_INET6) {
-	port = ntohs((unsigned short) s6p->sin6_port);
-      } else {
-	port = ntohs((unsigned short) s4p->sin_port);
-      }
+    if (statePtr->recvBufs == NULL) {
+      statePtr->recvBufs = (unsigned char *) ckalloc((unsigned) statePtr->recvBatch * CEP_RECV_SLOT);
+    }
+    bufs = statePtr->recvBufs;
+    n = statePtr->recvBatch;
+    msgs = (struct mmsghdr *) ckalloc((unsigned) ((size_t) n * sizeof(struct mmsghdr)));
+    iovs = (struct iovec *) ckalloc((unsigned) ((size_t) n * sizeof(struct iovec)));
+    addrs = (struct sockaddr_storage *) ckalloc((unsigned) ((size_t) n * sizeof(struct sockaddr_storage)));
+    (void) memset(msgs, 0, (size_t) n * sizeof(struct mmsghdr));
+    for (i = 0; i < n; i++) {
+      iovs[i].iov_base = bufs + (size_t) i * CEP_RECV_SLOT;
+      iovs[i].iov_len = CEP_RECV_SLOT;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+
+    n = recvmmsg(statePtr->fd, msgs, (unsigned) n, MSG_DONTWAIT, NULL);
+
+    /*
+     * Stop early if the callback closes the cep or changes -recvbatch,
+     * either of which releases the buffers.
+     */
+
+    for (i = 0; (i < n) && (statePtr->recvBufs == bufs); i++) {
+      ReceiverDeliver(statePtr, &addrs[i], msgs[i].msg_hdr.msg_namelen,
+		      (const unsigned char *) iovs[i].iov_base, (ssize_t) msgs[i].msg_len);
+    }
+
+    ckfree((char *) addrs);
+    ckfree((char *) iovs);
+    ckfree((char *) msgs);
+    Tcl_Release((ClientData) statePtr);
+    return;
+  }
+#endif
+
+  for (count = 0; (count < statePtr->recvBatch) && (statePtr->fd != -1); count++) {
+    /* This is actually the number of bytes + header */
+    if (ioctl(statePtr->fd, FIONREAD, &bytesAvail) == -1) {
+      Tcl_Panic("CepReceiverListen ioctl FIONREAD error (%s)", Tcl_ErrnoMsg(Tcl_GetErrno()));
     }
+    buf = (unsigned char *) ckalloc((unsigned) (bytesAvail > 0 ? bytesAvail : 1));
+    size = sizeof(struct sockaddr_storage);
+    bytesRead = recvfrom(statePtr->fd, buf, (size_t) bytesAvail, MSG_DONTWAIT, (struct sockaddr *) &sockaddr, &size);
+    if (bytesRead < 0) {
+      /*
+       * No more datagrams waiting.
+       */
 
-    (*statePtr->acceptProc)(statePtr->acceptProcData,
-			    statePtr->channel, (const char *) addrPtr, port,
-			    cepDomain, (unsigned) -1, (unsigned) bytesRead, (const unsigned char *) buf);
+      ckfree((char *) buf);
+      break;
+    }
+    ReceiverDeliver(statePtr, &sockaddr, size, (const unsigned char *) buf, bytesRead);
+    ckfree((char *) buf);
   }
-  ckfree((char *) buf);
+
+  Tcl_Release((ClientData) statePtr);
 }
 
 /*
@@ -2768,6 +3760,7 @@ int
 Cep_Sendto (Tcl_Channel chan, const char *host, int port, const unsigned char *data, int dataLen)
 {
   struct sockaddr_storage sockaddr;
+  socklen_t size;
   int cepDomain;
   int written;
 
@@ -2775,11 +3768,11 @@ Cep_Sendto (Tcl_Channel chan, const char *host, int port, const unsigned char *d
 
   cepDomain = MASK2DOMAIN(statePtr->flags);
 
-  if (CreateCepAddress(cepDomain, &sockaddr, host, port, (int) (statePtr->flags & (CEP_RESOLVE_NAMES))) != 0) {
+  if (CreateCepAddress(cepDomain, &sockaddr, &size, host, port, (int) (statePtr->flags & (CEP_RESOLVE_NAMES))) != 0) {
     return -1;
   }
 
-  written = sendto(statePtr->fd, data, (size_t) dataLen, 0, (struct sockaddr *) &sockaddr, GetSocketStructSize(cepDomain));
+  written = sendto(statePtr->fd, data, (size_t) dataLen, 0, (struct sockaddr *) &sockaddr, size);
 
   return written;
 }
@@ -2788,131 +3781,472 @@ Cep_Sendto (Tcl_Channel chan, const char *host, int port, const unsigned char *d
 /*
  *----------------------------------------------------------------------
  *
- * CepDomainToSysDomain --
+ * Cep_Send --
  *
+ *	Sends dataLen bytes from data with a single send() call,
+ *	bypassing the buffers of the Tcl channel.  On a seqpacket cep
+ *	the data makes up exactly one packet.
  *
  * Results:
- *
+ *	The number of bytes sent, or -1 with errno set.
  *
  * Side effects:
- *
- *
+ *	Sends data.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CepDomainToSysDomain (int cepDomain)
+int
+Cep_Send (Tcl_Channel chan, const unsigned char *data, int dataLen)
 {
-  switch (cepDomain) {
-  case CEP_LOCAL:
-    return AF_LOCAL;
-  case CEP_INET:
-    return AF_INET;
-  case CEP_INET6:
-    return AF_INET6;
-  default:
-    return -1;
-  }
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+
+  return send(statePtr->fd, data, (size_t) dataLen, 0);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * SysDomainToCepDomain --
+ * Cep_Writev --
  *
+ *	Writes the byte arrays objv[0..objc-1] with a single writev()
+ *	call, bypassing the buffers of the Tcl channel, so that data
+ *	held in several pieces needn't be copied together first.
+ *	At most CEP_IOV_MAX pieces are written at once.
  *
  * Results:
- *
+ *	The number of bytes written, which is short of the total on
+ *	a partial write and 0 if a non-blocking cep can't take any data
+ *	right now, or -1 with errno set.
  *
  * Side effects:
+ *	Writes data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Cep_Writev (Tcl_Channel chan, int objc, Tcl_Obj *const objv[])
+{
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+  struct iovec staticIov[CEP_IOV_STATIC];
+  struct iovec *iov = staticIov;
+  int i, len, written;
+
+  if (objc > CEP_IOV_MAX) {
+    objc = CEP_IOV_MAX;
+  }
+  if (objc > CEP_IOV_STATIC) {
+    iov = (struct iovec *) ckalloc((unsigned) ((size_t) objc * sizeof(struct iovec)));
+  }
+
+  for (i = 0; i < objc; i++) {
+    iov[i].iov_base = (void *) Tcl_GetByteArrayFromObj(objv[i], &len);
+    iov[i].iov_len = (size_t) len;
+  }
+
+  written = writev(statePtr->fd, iov, objc);
+  if (written == -1 && (Tcl_GetErrno() == EAGAIN || Tcl_GetErrno() == EWOULDBLOCK)) {
+    written = 0;
+  }
+
+  if (iov != staticIov) {
+    i = Tcl_GetErrno();
+    ckfree((char *) iov);
+    Tcl_SetErrno(i);
+  }
+
+  return written;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Cep_Recv --
  *
+ *	Receives the next packet of a cep into the byte array objPtr,
+ *	bypassing the buffers of the Tcl channel.  The size of the packet
+ *	is found out beforehand so that it is received whole by a single
+ *	recv() call into a buffer of just the right size.
+ *
+ * Results:
+ *	The length of the packet (0 at end of file), or -1 with errno set.
  *
+ * Side effects:
+ *	Consumes a packet.  Changes the length of objPtr.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-SysDomainToCepDomain (int sysDomain)
+int
+Cep_Recv (Tcl_Channel chan, Tcl_Obj *objPtr)
 {
-  switch (sysDomain) {
-  case AF_LOCAL:
-    return CEP_LOCAL;
-  case AF_INET:
-    return CEP_INET;
-  case AF_INET6:
-    return CEP_INET6;
-  default:
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+  unsigned char *buf;
+  int size;
+  char peek;
+
+  if (statePtr->readerPtr != NULL) {
+    Tcl_SetErrno(EBUSY);
+    return -1;
+  }
+
+#ifdef MSG_TRUNC
+  size = recv(statePtr->fd, &peek, 1, MSG_PEEK | MSG_TRUNC);
+#else
+  if (ioctl(statePtr->fd, FIONREAD, &size) == -1) {
+    size = -1;
+  }
+#endif
+  if (size == -1) {
+    if (Tcl_GetErrno() == ECONNRESET) {
+      size = 0;
+    } else {
+      return -1;
+    }
+  }
+
+  buf = Tcl_SetByteArrayLength(objPtr, size);
+  if (size == 0) {
+    /*
+     * Consume an empty packet, if that's what it was.
+     */
+
+    (void) recv(statePtr->fd, &peek, 0, 0);
+    return 0;
+  }
+
+  size = recv(statePtr->fd, buf, (size_t) size, 0);
+  if (size == -1) {
     return -1;
   }
+  Tcl_SetByteArrayLength(objPtr, size);
+
+  return size;
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * CepTypeToSysType --
+ * Cep_SetNotifier --
  *
+ *	Selects how readiness of ceps created from now on by the current
+ *	thread is watched:
+ *	"tcl" registers each cep with the Tcl notifier, "epoll"
+ *	dispatches all of them through a single epoll instance.
  *
  * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	May create the epoll instance and register it with the Tcl
+ *	notifier.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Cep_SetNotifier (interp, name)
+     Tcl_Interp *interp;		/* For error reporting. */
+     const char *name;			/* "tcl" or "epoll". */
+{
+  ThreadSpecificData *tsdPtr = GetThreadSpecificData();
+
+  if (strcmp(name, "tcl") == 0) {
+    tsdPtr->useEpoll = 0;
+    return TCL_OK;
+  }
+  if (strcmp(name, "epoll") == 0) {
+#ifdef CEP_HAVE_EPOLL
+    if (EpollInit(interp) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    tsdPtr->useEpoll = 1;
+    return TCL_OK;
+#else
+    return qseterr("epoll notifier is not supported on this platform");
+#endif
+  }
+  return Cep_SetInterpResultError(interp, "bad notifier \"", name,
+				  "\": must be tcl or epoll", (char *) NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Cep_GetNotifier --
  *
+ *	Returns the name of the notifier used for new ceps of the
+ *	current thread.
+ *
+ * Results:
+ *	"tcl" or "epoll".
  *
  * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char *
+Cep_GetNotifier ()
+{
+  return GetThreadSpecificData()->useEpoll ? "epoll" : "tcl";
+}
+
+/*
+ *----------------------------------------------------------------------
  *
+ * GetThreadSpecificData --
  *
+ *	Returns the notifier settings of the current thread.
+ *
+ * Results:
+ *	The per-thread data.
+ *
+ * Side effects:
+ *	Sets the data up when first called by a thread.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CepTypeToSysType (int cepType)
+static ThreadSpecificData *
+GetThreadSpecificData ()
 {
-  switch (cepType) {
-  case CEP_STREAM:
-    return SOCK_STREAM;
-  case CEP_DGRAM:
-    return SOCK_DGRAM;
-  case CEP_RAW:
-    return SOCK_RAW;
-  default:
-    return -1;
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+    Tcl_GetThreadData(&dataKey, (int) sizeof(ThreadSpecificData));
+
+  if (!tsdPtr->initialized) {
+    tsdPtr->useEpoll = 0;
+#ifdef CEP_HAVE_EPOLL
+    tsdPtr->epollFd = -1;
+#endif
+    tsdPtr->initialized = 1;
   }
+  return tsdPtr;
 }
 
+#ifdef CEP_HAVE_EPOLL
 /*
  *----------------------------------------------------------------------
  *
- * SysTypeToCepType --
+ * EpollInit --
  *
+ *	Creates the epoll instance of the current thread, unless it
+ *	already exists.
  *
  * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Registers the epoll fd with the Tcl notifier of the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EpollInit (interp)
+     Tcl_Interp *interp;		/* For error reporting. */
+{
+  ThreadSpecificData *tsdPtr = GetThreadSpecificData();
+
+  if (tsdPtr->epollFd != -1) {
+    return TCL_OK;
+  }
+
+#ifdef EPOLL_CLOEXEC
+  tsdPtr->epollFd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  tsdPtr->epollFd = epoll_create(CEP_EPOLL_MAXEVENTS);
+  if (tsdPtr->epollFd != -1) {
+    (void) fcntl(tsdPtr->epollFd, F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  if (tsdPtr->epollFd == -1) {
+    return qseterrpx("couldn't create epoll instance: ");
+  }
+
+  Tcl_InitHashTable(&tsdPtr->epollTable, TCL_ONE_WORD_KEYS);
+  Tcl_CreateFileHandler(tsdPtr->epollFd, TCL_READABLE, EpollDispatch, (ClientData) tsdPtr);
+  Tcl_CreateThreadExitHandler(EpollFinalize, (ClientData) tsdPtr);
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EpollFinalize --
  *
+ *	Closes the epoll instance of a thread when the thread exits.
+ *
+ * Results:
+ *	None.
  *
  * Side effects:
+ *	Ceps closed afterwards no longer deregister from it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EpollFinalize (data)
+     ClientData data;			/* The per-thread data. */
+{
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *) data;
+
+  Tcl_DeleteFileHandler(tsdPtr->epollFd);
+  (void) close(tsdPtr->epollFd);
+  tsdPtr->epollFd = -1;
+  Tcl_DeleteHashTable(&tsdPtr->epollTable);
+  tsdPtr->useEpoll = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
  *
+ * EpollWatch --
  *
+ *	Registers interest in the events in mask for the cep with
+ *	the epoll instance. A zero mask removes the cep from it.
+ *
+ * Results:
+ *	0 on success, -1 if epoll refused the fd.
+ *
+ * Side effects:
+ *	Updates the epoll interest list and table of the thread.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-SysTypeToCepType (int sysType)
+EpollWatch (statePtr, mask)
+     CepState *statePtr;		/* The cep state. */
+     int mask;				/* Events of interest. */
 {
-  switch (sysType) {
-  case SOCK_STREAM:
-    return CEP_STREAM;
-  case SOCK_DGRAM:
-    return CEP_DGRAM;
-  case SOCK_RAW:
-    return CEP_RAW;
-  default:
+  ThreadSpecificData *tsdPtr = GetThreadSpecificData();
+  struct epoll_event event;
+  Tcl_HashEntry *hPtr;
+  int isNew;
+  int op;
+
+  if (mask == statePtr->watchMask) {
+    return 0;
+  }
+  if (tsdPtr->epollFd == -1) {
+    /*
+     * The thread is exiting and its epoll instance is gone.
+     */
+
+    statePtr->watchMask = 0;
+    return (mask == 0) ? 0 : -1;
+  }
+
+  memset(&event, 0, sizeof(event));
+
+  if (mask == 0) {
+    (void) epoll_ctl(tsdPtr->epollFd, EPOLL_CTL_DEL, statePtr->fd, &event);
+    hPtr = Tcl_FindHashEntry(&tsdPtr->epollTable, (char *) (size_t) statePtr->fd);
+    if (hPtr != NULL) {
+      Tcl_DeleteHashEntry(hPtr);
+    }
+    statePtr->watchMask = 0;
+    return 0;
+  }
+
+  if (mask & TCL_READABLE) {
+    event.events |= EPOLLIN;
+  }
+  if (mask & TCL_WRITABLE) {
+    event.events |= EPOLLOUT;
+  }
+  if (mask & TCL_EXCEPTION) {
+    event.events |= EPOLLPRI;
+  }
+  event.data.fd = statePtr->fd;
+
+  op = (statePtr->watchMask == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(tsdPtr->epollFd, op, statePtr->fd, &event) != 0) {
     return -1;
   }
+
+  hPtr = Tcl_CreateHashEntry(&tsdPtr->epollTable, (char *) (size_t) statePtr->fd, &isNew);
+  Tcl_SetHashValue(hPtr, (ClientData) statePtr);
+  statePtr->watchMask = mask;
+
+  return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EpollDispatch --
+ *
+ *	Called by the Tcl notifier when the epoll fd is readable.
+ *	Fetches a batch of ready ceps and notifies their channels.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Invokes channel handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EpollDispatch (data, mask)
+     ClientData data;			/* The per-thread data. */
+     int mask;				/* Not used. */
+{
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *) data;
+  struct epoll_event events[CEP_EPOLL_MAXEVENTS];
+  Tcl_HashEntry *hPtr;
+  CepState *statePtr;
+  int readyMask;
+  int i, n;
+
+  n = epoll_wait(tsdPtr->epollFd, events, CEP_EPOLL_MAXEVENTS, 0);
+
+  for (i = 0; i < n; i++) {
+    /*
+     * A handler run for an earlier event might have closed this cep.
+     */
+
+    hPtr = Tcl_FindHashEntry(&tsdPtr->epollTable, (char *) (size_t) events[i].data.fd);
+    if (hPtr == NULL) {
+      continue;
+    }
+    statePtr = (CepState *) Tcl_GetHashValue(hPtr);
+
+    /*
+     * Report errors and hangups the way select() does.
+     */
+
+    readyMask = 0;
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      readyMask |= TCL_READABLE;
+    }
+    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      readyMask |= TCL_WRITABLE;
+    }
+    if (events[i].events & EPOLLPRI) {
+      readyMask |= TCL_EXCEPTION;
+    }
+    readyMask &= statePtr->watchMask;
+
+    if (readyMask) {
+      Tcl_NotifyChannel(statePtr->channel, readyMask);
+    }
+  }
 }
+#endif
 
 /*
  *----------------------------------------------------------------------
  *
- * GetSocketStructSize --
+ * CepDomainToSysDomain --
  *
  *
  * Results:
@@ -2925,26 +4259,25 @@ SysTypeToCepType (int sysType)
  *----------------------------------------------------------------------
  */
 
-static socklen_t
-GetSocketStructSize (cepDomain)
-     int cepDomain;
+static int
+CepDomainToSysDomain (int cepDomain)
 {
   switch (cepDomain) {
   case CEP_LOCAL:
-    return sizeof(struct sockaddr_un);
+    return AF_LOCAL;
   case CEP_INET:
-    return sizeof(struct sockaddr_in);
+    return AF_INET;
   case CEP_INET6:
-    return sizeof(struct sockaddr_in6);
+    return AF_INET6;
   default:
-    return 0;
+    return -1;
   }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * nameToAddr --
+ * SysDomainToCepDomain --
  *
  *
  * Results:
@@ -2958,21 +4291,237 @@ GetSocketStructSize (cepDomain)
  */
 
 static int
-NameToAddr (int family, const char *host, void *addrPtr, int resolve) {
-  struct hostent *hostent;		/* Host database entry */
-    Tcl_DString ds;
-    const char *native;
-
-    native = Tcl_UtfToExternalDString(NULL, host, -1, &ds);
-
-    if (inet_pton(family, native, addrPtr) != 1) {
-      if (resolve) {
-	hostent = gethostbyname2(native, family);
-      } else {
-	hostent = NULL;
-      }
-      if (hostent != NULL) {
-	memcpy(addrPtr, (void *) hostent->h_addr_list[0], (size_t) hostent->h_length);
+SysDomainToCepDomain (int sysDomain)
+{
+  switch (sysDomain) {
+  case AF_LOCAL:
+    return CEP_LOCAL;
+  case AF_INET:
+    return CEP_INET;
+  case AF_INET6:
+    return CEP_INET6;
+  default:
+    return -1;
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CepTypeToSysType --
+ *
+ *
+ * Results:
+ *
+ *
+ * Side effects:
+ *
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CepTypeToSysType (int cepType)
+{
+  switch (cepType) {
+  case CEP_STREAM:
+    return SOCK_STREAM;
+  case CEP_DGRAM:
+    return SOCK_DGRAM;
+  case CEP_SEQPACKET:
+    return SOCK_SEQPACKET;
+  case CEP_RAW:
+    return SOCK_RAW;
+  default:
+    return -1;
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SysTypeToCepType --
+ *
+ *
+ * Results:
+ *
+ *
+ * Side effects:
+ *
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SysTypeToCepType (int sysType)
+{
+  switch (sysType) {
+  case SOCK_STREAM:
+    return CEP_STREAM;
+  case SOCK_DGRAM:
+    return CEP_DGRAM;
+  case SOCK_SEQPACKET:
+    return CEP_SEQPACKET;
+  case SOCK_RAW:
+    return CEP_RAW;
+  default:
+    return -1;
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetSocketStructSize --
+ *
+ *
+ * Results:
+ *
+ *
+ * Side effects:
+ *
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+
+static socklen_t
+GetSocketStructSize (cepDomain)
+     int cepDomain;
+{
+  switch (cepDomain) {
+  case CEP_LOCAL:
+    return sizeof(struct sockaddr_un);
+  case CEP_INET:
+    return sizeof(struct sockaddr_in);
+  case CEP_INET6:
+    return sizeof(struct sockaddr_in6);
+  default:
+    return 0;
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetProtocolNumber --
+ *
+ *	Looks up a protocol by name in the protocol database.
+ *
+ * Results:
+ *	1 and the protocol number in protoPtr if found, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetProtocolNumber (name, protoPtr)
+     const char *name;			/* Protocol name, in UTF-8. */
+     int *protoPtr;
+{
+  struct protoent *pe;
+  Tcl_DString ds;
+  const char *native;
+
+  native = Tcl_UtfToExternalDString(NULL, name, -1, &ds);
+  Tcl_MutexLock(&netdbMutex);
+  pe = getprotobyname(native);
+  if (pe != NULL) {
+    *protoPtr = pe->p_proto;
+  }
+  Tcl_MutexUnlock(&netdbMutex);
+  Tcl_DStringFree(&ds);
+
+  return (pe != NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetProtocolName --
+ *
+ *	Looks up a protocol by number in the protocol database.
+ *
+ * Results:
+ *	1 and the name of the protocol in dsPtr, which the caller must
+ *	free, if found, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetProtocolName (proto, dsPtr)
+     int proto;
+     Tcl_DString *dsPtr;		/* Uninitialized. */
+{
+  struct protoent *pe;
+
+  Tcl_MutexLock(&netdbMutex);
+  pe = getprotobynumber(proto);
+  if (pe != NULL) {
+    Tcl_ExternalToUtfDString(NULL, pe->p_name, -1, dsPtr);
+  }
+  Tcl_MutexUnlock(&netdbMutex);
+
+  return (pe != NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * nameToAddr --
+ *
+ *
+ * Results:
+ *
+ *
+ * Side effects:
+ *
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+NameToAddr (int family, const char *host, void *addrPtr, int resolve) {
+  struct addrinfo hints;
+  struct addrinfo *res = NULL;		/* Host database entries; unlike
+					 * gethostbyname2(), getaddrinfo()
+					 * is thread-safe. */
+    Tcl_DString ds;
+    const char *native;
+
+    native = Tcl_UtfToExternalDString(NULL, host, -1, &ds);
+
+    if (inet_pton(family, native, addrPtr) != 1) {
+      if (resolve) {
+	(void) memset((void *) &hints, '\0', sizeof(hints));
+	hints.ai_family = family;
+	if ((getaddrinfo(native, NULL, &hints, &res) != 0) ||
+	    (res != NULL && res->ai_family != family)) {
+	  if (res != NULL) {
+	    freeaddrinfo(res);
+	  }
+	  res = NULL;
+	}
+      }
+      if (res != NULL) {
+	if (family == AF_INET6) {
+	  memcpy(addrPtr, (void *) &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr,
+		 sizeof(struct in6_addr));
+	} else {
+	  memcpy(addrPtr, (void *) &((struct sockaddr_in *) res->ai_addr)->sin_addr,
+		 sizeof(struct in_addr));
+	}
+	freeaddrinfo(res);
       } else {
 #ifdef	EHOSTUNREACH
 	Tcl_SetErrno(EHOSTUNREACH);
@@ -2993,6 +4542,1127 @@ NameToAddr (int family, const char *host, void *addrPtr, int resolve) {
     return 1;
 }
 
+#ifdef CEP_ASYNC_RESOLVE
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetAddressPort --
+ *
+ *	Stores a port number into an inet or inet6 address.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Modifies the address.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetAddressPort (sockaddrPtr, port)
+     struct sockaddr_storage *sockaddrPtr;
+     int port;
+{
+  if (sockaddrPtr->ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *) sockaddrPtr)->sin6_port = htons((unsigned short) (port & 0xFFFF));
+  } else {
+    ((struct sockaddr_in *) sockaddrPtr)->sin_port = htons((unsigned short) (port & 0xFFFF));
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveCacheKey --
+ *
+ *	Builds the key of the address cache for a host name looked up
+ *	in the given address family.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Initializes *dsPtr, which the caller must free.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ResolveCacheKey (family, host, dsPtr)
+     int family;
+     const char *host;
+     Tcl_DString *dsPtr;
+{
+  char familyBuf[TCL_INTEGER_SPACE];
+
+  (void) snprintf(familyBuf, TCL_INTEGER_SPACE, "%d", family);
+  Tcl_DStringInit(dsPtr);
+  Tcl_DStringAppendElement(dsPtr, familyBuf);
+  Tcl_DStringAppendElement(dsPtr, host);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveCacheLookup --
+ *
+ *	Looks up the address cache for a host name.
+ *
+ * Results:
+ *	1 if the host has been looked up less than CEP_RESOLVE_TTL
+ *	seconds ago, in which case its address with the given port
+ *	is stored in *sockaddrPtr and *sizePtr; 0 otherwise.
+ *
+ * Side effects:
+ *	A stale entry is dropped from the cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ResolveCacheLookup (family, host, port, sockaddrPtr, sizePtr)
+     int family;
+     const char *host;
+     int port;
+     struct sockaddr_storage *sockaddrPtr;
+     socklen_t *sizePtr;
+{
+  Tcl_DString key;
+  Tcl_HashEntry *hPtr;
+  ResolveCacheEntry *entryPtr;
+  Tcl_Time now;
+  int found = 0;
+
+  ResolveCacheKey(family, host, &key);
+  Tcl_GetTime(&now);
+
+  Tcl_MutexLock(&resolveMutex);
+  if (resolveCacheInitialized) {
+    hPtr = Tcl_FindHashEntry(&resolveCache, Tcl_DStringValue(&key));
+    if (hPtr != NULL) {
+      entryPtr = (ResolveCacheEntry *) Tcl_GetHashValue(hPtr);
+      if (entryPtr->expires > now.sec) {
+	*sockaddrPtr = entryPtr->sockaddr;
+	*sizePtr = entryPtr->size;
+	SetAddressPort(sockaddrPtr, port);
+	found = 1;
+      } else {
+	ckfree((char *) entryPtr);
+	Tcl_DeleteHashEntry(hPtr);
+      }
+    }
+  }
+  Tcl_MutexUnlock(&resolveMutex);
+
+  Tcl_DStringFree(&key);
+  return found;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveCacheStore --
+ *
+ *	Adds the address found by a lookup to the address cache.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Replaces the previous entry for the host, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ResolveCacheStore (resolvePtr)
+     CepResolve *resolvePtr;
+{
+  Tcl_HashEntry *hPtr;
+  ResolveCacheEntry *entryPtr;
+  Tcl_Time now;
+  int isNew;
+
+  Tcl_GetTime(&now);
+
+  Tcl_MutexLock(&resolveMutex);
+  if (!resolveCacheInitialized) {
+    Tcl_InitHashTable(&resolveCache, TCL_STRING_KEYS);
+    resolveCacheInitialized = 1;
+  }
+  hPtr = Tcl_CreateHashEntry(&resolveCache, resolvePtr->key, &isNew);
+  if (isNew) {
+    entryPtr = (ResolveCacheEntry *) ckalloc((unsigned) sizeof(ResolveCacheEntry));
+    Tcl_SetHashValue(hPtr, (ClientData) entryPtr);
+  } else {
+    entryPtr = (ResolveCacheEntry *) Tcl_GetHashValue(hPtr);
+  }
+  entryPtr->expires = now.sec + CEP_RESOLVE_TTL;
+  entryPtr->sockaddr = resolvePtr->sockaddr;
+  entryPtr->size = resolvePtr->size;
+  Tcl_MutexUnlock(&resolveMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartResolve --
+ *
+ *	Starts looking up the host an asynchronous client cep is to
+ *	connect to on a worker thread.
+ *
+ * Results:
+ *	The lookup, or NULL if the thread couldn't be created.
+ *
+ * Side effects:
+ *	Once the lookup is over, an event is queued to the current
+ *	thread which calls FinishResolve for the cep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CepResolve *
+StartResolve (statePtr, family, type, host, port)
+     CepState *statePtr;
+     int family;
+     int type;
+     const char *host;		/* Host name, in UTF-8. */
+     int port;
+{
+  CepResolve *resolvePtr;
+  Tcl_ThreadId threadId;
+  Tcl_DString ds;
+  const char *native;
+
+  resolvePtr = (CepResolve *) ckalloc((unsigned) sizeof(CepResolve));
+  (void) memset((void *) resolvePtr, '\0', sizeof(CepResolve));
+  resolvePtr->statePtr = statePtr;
+  resolvePtr->threadId = Tcl_GetCurrentThread();
+  resolvePtr->family = family;
+  resolvePtr->type = type;
+  resolvePtr->port = port;
+
+  native = Tcl_UtfToExternalDString(NULL, host, -1, &ds);
+  resolvePtr->host = ckalloc((unsigned) Tcl_DStringLength(&ds) + 1);
+  strcpy(resolvePtr->host, native);
+  Tcl_DStringFree(&ds);
+
+  ResolveCacheKey(family, host, &ds);
+  resolvePtr->key = ckalloc((unsigned) Tcl_DStringLength(&ds) + 1);
+  strcpy(resolvePtr->key, Tcl_DStringValue(&ds));
+  Tcl_DStringFree(&ds);
+
+  /*
+   * One reference for the cep, one for the worker thread.
+   */
+
+  resolvePtr->refCount = 2;
+  if (Tcl_CreateThread(&threadId, ResolveThread, (ClientData) resolvePtr,
+		       TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS) != TCL_OK) {
+    ckfree(resolvePtr->host);
+    ckfree(resolvePtr->key);
+    ckfree((char *) resolvePtr);
+    return NULL;
+  }
+  return resolvePtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseResolve --
+ *
+ *	Drops a reference to a lookup.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Frees the lookup along with the last reference.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseResolve (resolvePtr)
+     CepResolve *resolvePtr;
+{
+  int refCount;
+
+  Tcl_MutexLock(&resolveMutex);
+  refCount = --resolvePtr->refCount;
+  Tcl_MutexUnlock(&resolveMutex);
+
+  if (refCount == 0) {
+    Tcl_ConditionFinalize(&resolvePtr->cond);
+    ckfree(resolvePtr->host);
+    ckfree(resolvePtr->key);
+    ckfree((char *) resolvePtr);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveThread --
+ *
+ *	Body of the worker thread looking up a host name.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Stores the outcome in the lookup and, unless the cep has been
+ *	closed meanwhile, queues an event reporting it to the thread
+ *	of the cep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+ResolveThread (clientData)
+     ClientData clientData;
+{
+  CepResolve *resolvePtr = (CepResolve *) clientData;
+  struct addrinfo hints;
+  struct addrinfo *res = NULL;
+  ResolveEvent *evPtr;
+  int status;
+
+  (void) memset((void *) &hints, '\0', sizeof(hints));
+  hints.ai_family = resolvePtr->family;
+  hints.ai_socktype = resolvePtr->type;
+  status = getaddrinfo(resolvePtr->host, NULL, &hints, &res);
+
+  Tcl_MutexLock(&resolveMutex);
+  if ((status == 0) && (res != NULL) &&
+      (res->ai_addrlen <= sizeof(struct sockaddr_storage))) {
+    memcpy((void *) &resolvePtr->sockaddr, (void *) res->ai_addr, (size_t) res->ai_addrlen);
+    resolvePtr->size = res->ai_addrlen;
+  } else {
+    resolvePtr->error = EHOSTUNREACH;
+  }
+  resolvePtr->done = 1;
+  Tcl_ConditionNotify(&resolvePtr->cond);
+  if (resolvePtr->statePtr != NULL) {
+    /*
+     * The event takes over the reference of this thread.
+     */
+    evPtr = (ResolveEvent *) ckalloc((unsigned) sizeof(ResolveEvent));
+    evPtr->header.proc = ResolveEventProc;
+    evPtr->resolvePtr = resolvePtr;
+    Tcl_ThreadQueueEvent(resolvePtr->threadId, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(resolvePtr->threadId);
+    resolvePtr = NULL;
+  }
+  Tcl_MutexUnlock(&resolveMutex);
+
+  if (res != NULL) {
+    freeaddrinfo(res);
+  }
+  if (resolvePtr != NULL) {
+    ReleaseResolve(resolvePtr);
+  }
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveEventProc --
+ *
+ *	Handles the event reporting the outcome of a lookup to the
+ *	thread of the cep.
+ *
+ * Results:
+ *	1 if the event has been handled, 0 if it has to wait for
+ *	file events to be serviced.
+ *
+ * Side effects:
+ *	Starts connecting the cep, unless it has been closed or
+ *	connected meanwhile.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ResolveEventProc (evPtr, flags)
+     Tcl_Event *evPtr;
+     int flags;
+{
+  CepResolve *resolvePtr = ((ResolveEvent *) evPtr)->resolvePtr;
+  CepState *statePtr;
+
+  if (!(flags & TCL_FILE_EVENTS)) {
+    return 0;
+  }
+
+  Tcl_MutexLock(&resolveMutex);
+  statePtr = resolvePtr->statePtr;
+  Tcl_MutexUnlock(&resolveMutex);
+
+  if (statePtr != NULL) {
+    FinishResolve(statePtr);
+  }
+  ReleaseResolve(resolvePtr);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FinishResolve --
+ *
+ *	Starts connecting a cep once the lookup of the host is over.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The address found is cached. If the lookup or the connect
+ *	fails, the error is recorded to be reported by -error and
+ *	the I/O procedures. The cep is then watched for the events
+ *	requested meanwhile.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FinishResolve (statePtr)
+     CepState *statePtr;
+{
+  CepResolve *resolvePtr = statePtr->resolvePtr;
+  int mask = resolvePtr->mask;
+  int curState;
+
+  if (resolvePtr->error != 0) {
+    statePtr->connectError = resolvePtr->error;
+  } else {
+    ResolveCacheStore(resolvePtr);
+    SetAddressPort(&resolvePtr->sockaddr, resolvePtr->port);
+
+    /*
+     * The cep may have been put into blocking mode meanwhile,
+     * WaitForConnect will restore it.
+     */
+#ifndef USE_FIONBIO
+    curState = fcntl(statePtr->fd, F_GETFL);
+    (void) fcntl(statePtr->fd, F_SETFL, curState | O_NONBLOCK);
+#else /* USE_FIONBIO */
+    curState = 1;
+    (void) ioctl(statePtr->fd, FIONBIO, &curState);
+#endif /* !USE_FIONBIO */
+    if ((connect(statePtr->fd, (struct sockaddr *) &resolvePtr->sockaddr, resolvePtr->size) < 0) &&
+	(Tcl_GetErrno() != EINPROGRESS)) {
+      statePtr->connectError = Tcl_GetErrno();
+    }
+  }
+  if (statePtr->connectError != 0) {
+    statePtr->flags &= (~(CEP_ASYNC_CONNECT));
+  }
+
+  DetachResolve(statePtr);
+  if (mask) {
+    CepWatchProc((ClientData) statePtr, mask);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DetachResolve --
+ *
+ *	Makes a cep stop waiting for the lookup of its host.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The lookup no longer refers to the cep, and vice versa.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DetachResolve (statePtr)
+     CepState *statePtr;
+{
+  CepResolve *resolvePtr = statePtr->resolvePtr;
+
+  Tcl_MutexLock(&resolveMutex);
+  resolvePtr->statePtr = NULL;
+  Tcl_MutexUnlock(&resolveMutex);
+
+  statePtr->resolvePtr = NULL;
+  statePtr->flags &= (~(CEP_RESOLVING));
+  ReleaseResolve(resolvePtr);
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Cep_ReaderStart --
+ *
+ *	Starts a thread reading D-Bus messages from a stream cep.
+ *	The thread frames the messages and checks their fixed header;
+ *	each complete message is handed to the current thread as an
+ *	event, which appends "message" and the message to script and
+ *	evaluates it. The end of the stream is reported as "eof",
+ *	a bad header as "malformed" followed by the reason, and a read
+ *	error as "error" followed by its message; the thread exits then.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Data held in the input buffers of the channel is taken over by
+ *	the reader. The channel can't be read from until the reader is
+ *	stopped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Cep_ReaderStart (interp, chan, maxMessage, maxBuffered, scriptPtr)
+     Tcl_Interp *interp;		/* Interpreter to run script in. */
+     Tcl_Channel chan;			/* The cep. */
+     int maxMessage;			/* Largest message accepted. */
+     int maxBuffered;			/* Read-ahead limit. */
+     Tcl_Obj *scriptPtr;		/* Command prefix. */
+{
+#ifdef CEP_DBUS_READER
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+  CepReader *readerPtr;
+  int buffered;
+  int flags;
+
+  if (statePtr->readerPtr != NULL) {
+    return Cep_SetInterpResultError(interp, "channel \"", Tcl_GetChannelName(chan),
+				    "\" already has a reader", (char *) NULL);
+  }
+  if ((MASK2TYPE(statePtr->flags) != CEP_STREAM) || (statePtr->acceptProc != NULL)) {
+    return Cep_SetInterpResultError(interp, "channel \"", Tcl_GetChannelName(chan),
+				    "\" is not a connected stream cep", (char *) NULL);
+  }
+
+  readerPtr = (CepReader *) ckalloc((unsigned) sizeof(CepReader));
+  (void) memset((void *) readerPtr, '\0', sizeof(CepReader));
+  if (pipe(readerPtr->wakeFds) != 0) {
+    ckfree((char *) readerPtr);
+    return qseterrpx("couldn't start reader: ");
+  }
+  for (flags = 0; flags < 2; flags++) {
+    (void) fcntl(readerPtr->wakeFds[flags], F_SETFD, FD_CLOEXEC);
+  }
+  (void) fcntl(readerPtr->wakeFds[0], F_SETFL, O_NONBLOCK);
+
+  readerPtr->statePtr = statePtr;
+  readerPtr->fd = statePtr->fd;
+  readerPtr->ownerId = Tcl_GetCurrentThread();
+  readerPtr->interp = interp;
+  readerPtr->scriptPtr = scriptPtr;
+  readerPtr->maxMessage = maxMessage;
+  readerPtr->maxBuffered = maxBuffered;
+  readerPtr->bufSize = CEP_READER_CHUNK;
+
+  /*
+   * Whatever Tcl has read ahead comes first.
+   */
+
+  buffered = Tcl_InputBuffered(chan);
+  if (buffered > readerPtr->bufSize) {
+    readerPtr->bufSize = buffered;
+  }
+  readerPtr->buf = (unsigned char *) ckalloc((unsigned) readerPtr->bufSize);
+  if (buffered > 0) {
+    Tcl_DString blocking;
+
+    /*
+     * Tcl_ReadRaw() would bypass data put back with Tcl_Ungets(), and
+     * Tcl_Read() must not wait for the socket, hence the mode switch.
+     */
+
+    Tcl_DStringInit(&blocking);
+    (void) Tcl_GetChannelOption(NULL, chan, "-blocking", &blocking);
+    (void) Tcl_SetChannelOption(NULL, chan, "-blocking", "0");
+    readerPtr->bufLen = Tcl_Read(chan, (char *) readerPtr->buf, buffered);
+    (void) Tcl_SetChannelOption(NULL, chan, "-blocking", Tcl_DStringValue(&blocking));
+    Tcl_DStringFree(&blocking);
+    if (readerPtr->bufLen < 0) {
+      readerPtr->bufLen = 0;
+    }
+  }
+
+  if (Tcl_CreateThread(&readerPtr->threadId, ReaderThread, (ClientData) readerPtr,
+		       TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+    if (readerPtr->bufLen > 0) {
+      Tcl_Ungets(chan, (char *) readerPtr->buf, readerPtr->bufLen, 0);
+    }
+    (void) close(readerPtr->wakeFds[0]);
+    (void) close(readerPtr->wakeFds[1]);
+    ckfree((char *) readerPtr->buf);
+    ckfree((char *) readerPtr);
+    return qseterr("couldn't start reader: can't create thread");
+  }
+
+  Tcl_IncrRefCount(scriptPtr);
+  Tcl_CallWhenDeleted(interp, ReaderInterpDeleted, (ClientData) readerPtr);
+  statePtr->readerPtr = readerPtr;
+  CepWatchProc((ClientData) statePtr, statePtr->interest);
+
+  return TCL_OK;
+#else
+  return qseterr("couldn't start reader: Tcl is built without threads");
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Cep_ReaderPause --
+ *
+ *	Pauses or resumes the D-Bus reader of a cep. While paused, the
+ *	reader reads no further and messages it has found already are
+ *	held back.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Cep_ReaderPause (interp, chan, pause)
+     Tcl_Interp *interp;		/* For error reporting. */
+     Tcl_Channel chan;			/* The cep. */
+     int pause;				/* Pause or resume? */
+{
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+
+  if (statePtr->readerPtr == NULL) {
+    return Cep_SetInterpResultError(interp, "channel \"", Tcl_GetChannelName(chan),
+				    "\" has no reader", (char *) NULL);
+  }
+#ifdef CEP_DBUS_READER
+  Tcl_MutexLock(&readerMutex);
+  statePtr->readerPtr->paused = pause;
+  Tcl_ConditionNotify(&statePtr->readerPtr->cond);
+  Tcl_MutexUnlock(&readerMutex);
+#endif
+
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Cep_ReaderStop --
+ *
+ *	Stops the D-Bus reader of a cep.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Messages not delivered yet and data read past the last of them
+ *	are put back into the channel, to be read from it as usual.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Cep_ReaderStop (interp, chan)
+     Tcl_Interp *interp;		/* For error reporting. */
+     Tcl_Channel chan;			/* The cep. */
+{
+  CepState *statePtr = (CepState *) Tcl_GetChannelInstanceData(chan);
+
+  if (statePtr->readerPtr == NULL) {
+    return Cep_SetInterpResultError(interp, "channel \"", Tcl_GetChannelName(chan),
+				    "\" has no reader", (char *) NULL);
+  }
+#ifdef CEP_DBUS_READER
+  StopReader(statePtr, 1);
+#endif
+
+  return TCL_OK;
+}
+
+#ifdef CEP_DBUS_READER
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderThread --
+ *
+ *	The body of a D-Bus reader thread: reads from the cep until
+ *	told to stop or the stream ends, posting the messages found.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Queues events to the thread of the cep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+ReaderThread (clientData)
+     ClientData clientData;		/* The reader. */
+{
+  CepReader *readerPtr = (CepReader *) clientData;
+  struct pollfd fds[2];
+  const char *reason = NULL;
+  char drain[16];
+  int status = -1;
+  int error = 0;
+  int stopping;
+  int n;
+
+  fds[0].fd = readerPtr->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = readerPtr->wakeFds[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    status = ReaderFrame(readerPtr, &reason);
+    if (status != -1) {
+      break;
+    }
+
+    /*
+     * Let the thread of the cep catch up if it's falling behind.
+     */
+
+    Tcl_MutexLock(&readerMutex);
+    while (!readerPtr->stopping &&
+	   (readerPtr->paused || (readerPtr->queued >= readerPtr->maxBuffered) ||
+	    ((readerPtr->queued > 0) &&
+	     (readerPtr->queued + readerPtr->pending > readerPtr->maxBuffered)))) {
+      Tcl_ConditionWait(&readerPtr->cond, &readerMutex, NULL);
+    }
+    stopping = readerPtr->stopping;
+    Tcl_MutexUnlock(&readerMutex);
+    if (stopping) {
+      break;
+    }
+
+    /*
+     * Only make room for the rest of a large message once it fits
+     * in what the thread of the cep is willing to hold.
+     */
+
+    if (readerPtr->bufSize < readerPtr->pending) {
+      readerPtr->bufSize = readerPtr->pending;
+      readerPtr->buf = (unsigned char *) ckrealloc((char *) readerPtr->buf,
+						   (unsigned) readerPtr->bufSize);
+    }
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      status = CEP_READER_ERROR;
+      error = errno;
+      break;
+    }
+    if (fds[1].revents) {
+      while (read(readerPtr->wakeFds[0], drain, sizeof(drain)) > 0) {
+	/* Empty */
+      }
+      continue;
+    }
+
+    n = (int) read(readerPtr->fd, readerPtr->buf + readerPtr->bufLen,
+		   (size_t) (readerPtr->bufSize - readerPtr->bufLen));
+    if (n > 0) {
+      readerPtr->bufLen += n;
+    } else if (n == 0) {
+      status = CEP_READER_EOF;
+      break;
+    } else if (errno == ECONNRESET) {
+      status = CEP_READER_EOF;
+      break;
+    } else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      status = CEP_READER_ERROR;
+      error = errno;
+      break;
+    }
+  }
+
+  if (status != -1) {
+    ReaderPost(readerPtr, status, reason, (reason != NULL) ? (int) strlen(reason) : 0, error);
+    Tcl_ThreadAlert(readerPtr->ownerId);
+  }
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderFrame --
+ *
+ *	Posts the complete messages in the buffer of a reader and moves
+ *	what's left of it to the front, noting the size of the message
+ *	it starts. The fixed header of each message is checked the way
+ *	tcldbus does; no message may be larger than maxBuffered either.
+ *
+ * Results:
+ *	-1, or CEP_READER_MALFORMED with the reason in reasonPtr.
+ *
+ * Side effects:
+ *	May queue events to the thread of the cep and grow the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ReaderFrame (readerPtr, reasonPtr)
+     CepReader *readerPtr;
+     const char **reasonPtr;
+{
+  unsigned char *p;
+  Tcl_WideInt size;
+  unsigned long bodySize;
+  unsigned long fieldsSize;
+  int bufSize = readerPtr->bufSize;
+  int ix = 0;
+  int posted = 0;
+  int status = -1;
+
+  readerPtr->pending = 0;
+  while (readerPtr->bufLen - ix >= 16) {
+    p = readerPtr->buf + ix;
+
+    if ((signed char) p[3] > 1) {
+      *reasonPtr = "unsupported protocol version";
+    } else if ((signed char) p[1] < 1) {
+      *reasonPtr = "invalid message type";
+    } else if ((p[0] != 'l') && (p[0] != 'B')) {
+      *reasonPtr = "invalid bytesex specifier";
+    }
+    if (*reasonPtr != NULL) {
+      status = CEP_READER_MALFORMED;
+      break;
+    }
+
+    if (p[0] == 'l') {
+      bodySize = (unsigned long) p[4] | ((unsigned long) p[5] << 8) |
+	((unsigned long) p[6] << 16) | ((unsigned long) p[7] << 24);
+      fieldsSize = (unsigned long) p[12] | ((unsigned long) p[13] << 8) |
+	((unsigned long) p[14] << 16) | ((unsigned long) p[15] << 24);
+    } else {
+      bodySize = ((unsigned long) p[4] << 24) | ((unsigned long) p[5] << 16) |
+	((unsigned long) p[6] << 8) | (unsigned long) p[7];
+      fieldsSize = ((unsigned long) p[12] << 24) | ((unsigned long) p[13] << 16) |
+	((unsigned long) p[14] << 8) | (unsigned long) p[15];
+    }
+    if (fieldsSize > 0x04000000) {
+      *reasonPtr = "array length exceeds limit";
+      status = CEP_READER_MALFORMED;
+      break;
+    }
+    size = 16 + (Tcl_WideInt) ((fieldsSize + 7) & ~7UL) + (Tcl_WideInt) bodySize;
+    if ((size > readerPtr->maxMessage) || (size > readerPtr->maxBuffered)) {
+      *reasonPtr = "message size exceeds limit";
+      status = CEP_READER_MALFORMED;
+      break;
+    }
+
+    if (readerPtr->bufLen - ix < size) {
+      readerPtr->pending = (int) size;
+      break;
+    }
+
+    ReaderPost(readerPtr, CEP_READER_MESSAGE, (const char *) p, (int) size, 0);
+    posted = 1;
+    ix += (int) size;
+  }
+
+  if (ix > 0) {
+    readerPtr->bufLen -= ix;
+    memmove(readerPtr->buf, readerPtr->buf + ix, (size_t) readerPtr->bufLen);
+  }
+  if (posted) {
+    Tcl_ThreadAlert(readerPtr->ownerId);
+  }
+
+  /*
+   * Keep room for a read of CEP_READER_CHUNK bytes; ReaderThread makes
+   * room for the rest of a large message.
+   */
+
+  if (readerPtr->bufSize < readerPtr->bufLen + CEP_READER_CHUNK) {
+    readerPtr->bufSize = readerPtr->bufLen + CEP_READER_CHUNK;
+  }
+  if (readerPtr->bufSize != bufSize) {
+    readerPtr->buf = (unsigned char *) ckrealloc((char *) readerPtr->buf,
+						 (unsigned) readerPtr->bufSize);
+  }
+
+  return status;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderPost --
+ *
+ *	Queues an event reporting a message or the end of the stream
+ *	to the thread of the cep of a reader.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Copies the data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReaderPost (readerPtr, status, data, length, error)
+     CepReader *readerPtr;
+     int status;			/* One of CEP_READER_*. */
+     const char *data;
+     int length;
+     int error;				/* POSIX error code. */
+{
+  ReaderEvent *evPtr;
+
+  evPtr = (ReaderEvent *) ckalloc((unsigned) sizeof(ReaderEvent));
+  evPtr->header.proc = ReaderEventProc;
+  evPtr->readerPtr = readerPtr;
+  evPtr->status = status;
+  evPtr->data = ckalloc((unsigned) length + 1);
+  memcpy(evPtr->data, data, (size_t) length);
+  evPtr->length = length;
+  evPtr->error = error;
+
+  if (status == CEP_READER_MESSAGE) {
+    Tcl_MutexLock(&readerMutex);
+    readerPtr->queued += length;
+    Tcl_MutexUnlock(&readerMutex);
+  }
+  Tcl_ThreadQueueEvent(readerPtr->ownerId, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderEventProc --
+ *
+ *	Delivers what a reader thread has reported to the script
+ *	of the reader, unless the reader is paused.
+ *
+ * Results:
+ *	1 if the event has been delivered, 0 otherwise.
+ *
+ * Side effects:
+ *	Evaluates the script; errors are reported as background errors.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ReaderEventProc (evPtr, flags)
+     Tcl_Event *evPtr;
+     int flags;
+{
+  ReaderEvent *readerEvPtr = (ReaderEvent *) evPtr;
+  CepReader *readerPtr = readerEvPtr->readerPtr;
+  Tcl_Interp *interp;
+  Tcl_Obj *cmdPtr;
+  Tcl_Obj *dataPtr;
+
+  if (!(flags & TCL_FILE_EVENTS) || (readerPtr == NULL)) {
+    return 0;
+  }
+
+  /*
+   * Only the thread of the cep changes paused.
+   */
+
+  if (readerPtr->paused) {
+    return 0;
+  }
+
+  if (readerEvPtr->status == CEP_READER_MESSAGE) {
+    Tcl_MutexLock(&readerMutex);
+    readerPtr->queued -= readerEvPtr->length;
+    Tcl_ConditionNotify(&readerPtr->cond);
+    Tcl_MutexUnlock(&readerMutex);
+    dataPtr = Tcl_NewByteArrayObj((unsigned char *) readerEvPtr->data, readerEvPtr->length);
+  } else if (readerEvPtr->status == CEP_READER_ERROR) {
+    dataPtr = Tcl_NewStringObj(Tcl_ErrnoMsg(readerEvPtr->error), -1);
+  } else {
+    dataPtr = Tcl_NewStringObj(readerEvPtr->data, readerEvPtr->length);
+  }
+  ckfree(readerEvPtr->data);
+  readerEvPtr->data = NULL;
+
+  /*
+   * The script may stop the reader or close the cep: it must not
+   * find this event any more, and nothing of the reader may be
+   * touched afterwards.
+   */
+
+  readerEvPtr->readerPtr = NULL;
+  interp = readerPtr->interp;
+  if (interp == NULL) {
+    Tcl_DecrRefCount(dataPtr);
+    return 1;
+  }
+  cmdPtr = Tcl_DuplicateObj(readerPtr->scriptPtr);
+  Tcl_IncrRefCount(cmdPtr);
+  Tcl_ListObjAppendElement(NULL, cmdPtr,
+			   Tcl_NewStringObj(readerStatusNames[readerEvPtr->status], -1));
+  Tcl_ListObjAppendElement(NULL, cmdPtr, dataPtr);
+
+  Tcl_Preserve((ClientData) interp);
+  if (Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+    Tcl_BackgroundError(interp);
+  }
+  Tcl_Release((ClientData) interp);
+  Tcl_DecrRefCount(cmdPtr);
+
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderDeleteProc --
+ *
+ *	Tcl_DeleteEvents callback removing the events of a stopped
+ *	reader; the messages they hold are collected.
+ *
+ * Results:
+ *	1 for events of the reader, 0 for others.
+ *
+ * Side effects:
+ *	Appends messages to the DString of the reader.
+ *
+ *----------------------------------------------------------------------
+ */
+
+typedef struct ReaderCollect {
+  CepReader *readerPtr;
+  Tcl_DString *dsPtr;		/* Where messages go, or NULL. */
+} ReaderCollect;
+
+static int
+ReaderDeleteProc (evPtr, clientData)
+     Tcl_Event *evPtr;
+     ClientData clientData;		/* A ReaderCollect. */
+{
+  ReaderCollect *collectPtr = (ReaderCollect *) clientData;
+  ReaderEvent *readerEvPtr = (ReaderEvent *) evPtr;
+
+  if ((evPtr->proc != ReaderEventProc) ||
+      (readerEvPtr->readerPtr != collectPtr->readerPtr)) {
+    return 0;
+  }
+  if ((readerEvPtr->status == CEP_READER_MESSAGE) && (collectPtr->dsPtr != NULL)) {
+    Tcl_DStringAppend(collectPtr->dsPtr, readerEvPtr->data, readerEvPtr->length);
+  }
+  ckfree(readerEvPtr->data);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReaderInterpDeleted --
+ *
+ *	Called when the interpreter of a reader is deleted while
+ *	the reader still runs, which it may do if the cep is shared.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Further reports of the reader are dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReaderInterpDeleted (clientData, interp)
+     ClientData clientData;		/* The reader. */
+     Tcl_Interp *interp;		/* Not used. */
+{
+  ((CepReader *) clientData)->interp = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StopReader --
+ *
+ *	Makes the reader thread of a cep exit and waits for it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Undelivered messages and the data read past them are put back
+ *	into the channel if keep is set, and discarded otherwise.
+ *	Reports of the end of the stream are dropped, since reading
+ *	from the channel comes across it again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StopReader (statePtr, keep)
+     CepState *statePtr;
+     int keep;				/* Put data back into the channel? */
+{
+  CepReader *readerPtr = statePtr->readerPtr;
+  ReaderCollect collect;
+  Tcl_DString ds;
+  int result;
+
+  Tcl_MutexLock(&readerMutex);
+  readerPtr->stopping = 1;
+  Tcl_ConditionNotify(&readerPtr->cond);
+  Tcl_MutexUnlock(&readerMutex);
+  (void) write(readerPtr->wakeFds[1], "x", 1);
+  (void) Tcl_JoinThread(readerPtr->threadId, &result);
+
+  Tcl_DStringInit(&ds);
+  collect.readerPtr = readerPtr;
+  collect.dsPtr = keep ? &ds : NULL;
+  Tcl_DeleteEvents(ReaderDeleteProc, (ClientData) &collect);
+
+  statePtr->readerPtr = NULL;
+  if (keep) {
+    Tcl_DStringAppend(&ds, (char *) readerPtr->buf, readerPtr->bufLen);
+    if (Tcl_DStringLength(&ds) > 0) {
+      Tcl_Ungets(statePtr->channel, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), 0);
+    }
+    CepWatchProc((ClientData) statePtr, statePtr->interest);
+  }
+  Tcl_DStringFree(&ds);
+
+  (void) close(readerPtr->wakeFds[0]);
+  (void) close(readerPtr->wakeFds[1]);
+  Tcl_ConditionFinalize(&readerPtr->cond);
+  Tcl_DecrRefCount(readerPtr->scriptPtr);
+  if (readerPtr->interp != NULL) {
+    Tcl_DontCallWhenDeleted(readerPtr->interp, ReaderInterpDeleted, (ClientData) readerPtr);
+  }
+  ckfree((char *) readerPtr->buf);
+  ckfree((char *) readerPtr);
+}
+#endif
+
 /*
  *----------------------------------------------------------------------
  *
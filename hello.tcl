@@ -4,13 +4,9 @@ package require dbus
 set chan [::dbus::endpoint -bus -timeout 1000 system]
 #set chan [::dbus::endpoint -bus -timeout 1000 session]
 #set chan [::dbus::endpoint -bus -timeout 1000 unix:path=/tmp/dbus_test]
+# With -bus, Hello is sent along with the authentication handshake.
 puts Connected
 
-puts {Sending Hello}
-dbus::invoke $chan /org/freedesktop/DBus org.freedesktop.DBus.Hello \
-	-destination org.freedesktop.DBus
-puts {Hello answered}
-
 puts {Emitting a signal}
 dbus::emit $chan /ru/jabber/tkabber/Gobble ru.jabber.tkabber.GobbleWasFizzled \
 	-signature ii \
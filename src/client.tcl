@@ -7,6 +7,10 @@ package require uuid
 namespace eval ::dbus {
 	variable default_system_bus_instance unix:path=/var/run/dbus/system_bus_socket
 
+	# Delay (in ms) after which the next address from an address list
+	# is tried while the previous attempts are still in progress:
+	variable connect_stagger 250
+
 	# TODO list of known mechs should take into account what's provided by
 	# the SASL package.
 	#variable known_mechs {EXTERNAL ANONYMOUS DBUS_COOKIE_SHA1}
@@ -18,6 +22,25 @@ namespace eval ::dbus {
 		ANONYMOUS          AuthCallbackAnonymous \
 		DBUS_COOKIE_SHA1   AuthCallbackDBusCookieSHA1 \
 	]
+
+	# Per-connection options accepted by [endpoint] and [configure]
+	# along with their default values:
+	variable chan_options
+	array set chan_options {
+		-coalesce    16384
+		-weights     {reply 8 call 4 signal 1}
+		-starvation  64
+		-maxmessage  16777216
+		-maxbuffered 16777216
+		-maxqueued   1024
+		-iothread    0
+		-latency     20
+	}
+
+	# Per-connection options which are socket options of the underlying
+	# cep; they are passed on to it and left at the system's defaults
+	# unless specified:
+	variable sock_options {-cork -nodelay -receivebuffer -sendbuffer}
 }
 
 proc ::dbus::GenUUID {} {
@@ -36,6 +59,169 @@ proc ::dbus::NextSerial chan {
 	set serial
 }
 
+# Validates the value $value of the per-connection option $opt.
+# Raises an error if either the option or its value is invalid.
+proc ::dbus::ChanCheckOption {opt value} {
+	switch -- $opt {
+		-coalesce -
+		-latency {
+			if {![string is integer -strict $value] || $value < 0} {
+				return -code error "Bad value for $opt \"$value\":\
+					must be a non-negative integer"
+			}
+		}
+		-weights {
+			variable lanes
+			if {[catch {llength $value} n] || $n % 2 != 0} {
+				return -code error "Bad value for $opt \"$value\":\
+					must be a list of lane names and weights"
+			}
+			foreach {lane weight} $value {
+				if {[lsearch -exact $lanes $lane] < 0} {
+					return -code error "Bad lane \"$lane\":\
+						must be reply, call or signal"
+				}
+				if {![string is integer -strict $weight] || $weight < 0} {
+					return -code error "Bad weight \"$weight\" for lane $lane:\
+						must be a non-negative integer"
+				}
+			}
+		}
+		-starvation  -
+		-maxbuffered -
+		-maxqueued   -
+		-sendbuffer  -
+		-receivebuffer {
+			if {![string is integer -strict $value] || $value < 1} {
+				return -code error "Bad value for $opt \"$value\":\
+					must be a positive integer"
+			}
+		}
+		-maxmessage {
+			# The protocol limits messages to 128 MiB:
+			if {![string is integer -strict $value]
+					|| $value < 16 || $value > 134217728} {
+				return -code error "Bad value for $opt \"$value\":\
+					must be an integer between 16 and 134217728"
+			}
+		}
+		-iothread -
+		-nodelay  -
+		-cork {
+			if {![string is boolean -strict $value]} {
+				return -code error "Bad value for $opt \"$value\":\
+					must be a boolean"
+			}
+		}
+		default {
+			return -code error "Bad option \"$opt\":\
+				must be one of -coalesce, -cork, -iothread, -latency,\
+				-maxbuffered, -maxmessage, -maxqueued, -nodelay,\
+				-receivebuffer, -sendbuffer, -starvation or -weights"
+		}
+	}
+}
+
+# Sets up per-connection state of a newly created channel $chan:
+# initializes its options to their default values, then applies
+# those specified in the even list $opts.
+proc ::dbus::ChanInit {chan opts} {
+	variable chan_options
+
+	OutQueueInit $chan
+	InQueueInit $chan
+	# Messages are written to ceps bypassing the channel buffer;
+	# seqpacket ceps carry each message in a packet of its own:
+	variable $chan; upvar 0 $chan state
+	if {[catch {fconfigure $chan -type} type]} {
+		set state(packets) 0
+		set state(writev)  0
+	} else {
+		set state(packets) [string equal $type seqpacket]
+		set state(writev)  [expr {!$state(packets)}]
+		# The send queue already coalesces messages, so Nagle's
+		# algorithm would only hold them back on TCP connections:
+		if {[string equal $type stream]
+				&& ![string equal [fconfigure $chan -domain] local]} {
+			fconfigure $chan -nodelay 1
+		}
+	}
+	foreach {opt value} [array get chan_options] {
+		ChanSetOption $chan $opt $value
+	}
+	foreach {opt value} $opts {
+		ChanSetOption $chan $opt $value
+	}
+}
+
+proc ::dbus::ChanSetOption {chan opt value} {
+	variable sock_options
+	variable $chan; upvar 0 $chan state
+
+	ChanCheckOption $opt $value
+	if {[lsearch -exact $sock_options $opt] >= 0} {
+		if {[catch {fconfigure $chan $opt $value} err]} {
+			return -code error "Can't set $opt on \"$chan\": $err"
+		}
+		return
+	}
+	# Messages can only be read by a thread of ceptcl from stream ceps:
+	if {[string equal $opt -iothread] && [string is true $value]
+			&& !([info exists ::tcl_platform(threaded)] && $state(writev)
+			&& [llength [info commands ::cep::dbusreader]])} {
+		return -code error "Can't set $opt on \"$chan\":\
+			reading on a separate thread is not supported"
+	}
+	set state([string range $opt 1 end]) $value
+
+	switch -- $opt {
+		-coalesce {
+			# Make the channel buffer large enough for the whole
+			# send queue to go out in a single write:
+			if {$value > 4096} {
+				fconfigure $chan -buffersize \
+					[expr {$value < 1048576 ? $value : 1048576}]
+			}
+			if {$state(outqlen) >= $value} {
+				OutQueueFlush $chan
+			}
+		}
+		-weights {
+			# Lanes not mentioned keep their current weights:
+			variable lanes
+			foreach {lane weight} $value {
+				set state(weight,$lane) $weight
+			}
+			set state(weights) [list]
+			foreach lane $lanes {
+				lappend state(weights) $lane $state(weight,$lane)
+			}
+		}
+		-maxbuffered -
+		-maxqueued {
+			# Re-check the limits if reading is under way:
+			if {[llength $state(inq)] > 0 || $state(suspended)} {
+				InQueueThrottle $chan
+			}
+			if {[string equal $opt -maxbuffered]} {
+				ChanRestartReader $chan
+			}
+		}
+		-maxmessage {
+			ChanRestartReader $chan
+		}
+		-iothread {
+			# Otherwise the reader is switched once the message
+			# being read is complete:
+			if {[info exists state(reader)]
+					&& [string equal [lindex $state(script) 0] ProcessHeaderPrologue]
+					&& [string length $state(buffer)] == 0} {
+				ChanSelectReader $chan
+			}
+		}
+	}
+}
+
 proc ::dbus::SystemBusName {} {
 	global env
 
@@ -47,14 +233,34 @@ proc ::dbus::SystemBusName {} {
 	}
 }
 
+# Returns the address of the session bus.
+# Besides the environment, the well-known socket in $XDG_RUNTIME_DIR
+# is looked for before resorting to the root window property set by
+# dbus-launch, which requires running xprop. The result of the latter
+# is cached, unless it's empty, since X may just not be reachable yet.
 proc ::dbus::SessionBusName {} {
 	global env
+	variable session_bus_address
 
 	if {[info exists env(DBUS_SESSION_BUS_ADDRESS)]} {
 		return $env(DBUS_SESSION_BUS_ADDRESS)
 	}
 
-	GetSessionBusXProp
+	if {[info exists env(XDG_RUNTIME_DIR)]} {
+		set path [file join $env(XDG_RUNTIME_DIR) bus]
+		if {![catch {file type $path} type] && [string equal $type socket]} {
+			return unix:path=[EscapeAddressValue $path]
+		}
+	}
+
+	if {![info exists session_bus_address]} {
+		set address [GetSessionBusXProp]
+		if {$address == ""} {
+			return ""
+		}
+		set session_bus_address $address
+	}
+	set session_bus_address
 }
 
 proc ::dbus::GetSessionBusXProp {} {
@@ -109,11 +315,15 @@ proc ::dbus::ParseServerAddress address {
 	foreach addr [split $address \;] {
 		if {$addr == ""} continue
 
-		if {![regexp {^(.+?):(.+)$} $addr -> method tail]} {
+		if {![regexp {^(.+?):(.*)$} $addr -> method tail]} {
 			return -code error "Malformed server address"
 		}
 
 		set parts [list]
+		if {$tail == ""} {
+			lappend out $method $parts
+			continue
+		}
 		foreach part [split $tail ,] {
 			if {![regexp {^(.+?)=(.+)$} $part -> key val]} {
 				return -code error "Malformed server address"
@@ -136,6 +346,20 @@ proc ::dbus::HexToAscii s {
 	binary format H* $s
 }
 
+# Returns the name of the Unix-domain socket specified by
+# the address parameters $spec of the unix or seqpacket transport.
+proc ::dbus::LocalSocketPath spec {
+	array set params $spec
+	if {[info exists params(path)]} {
+		return $params(path)
+	} elseif {[info exists params(abstract)]} {
+		# Names in the abstract namespace start with NUL:
+		return \0$params(abstract)
+	} else {
+		return -code error "Required address component missing: path or abstract"
+	}
+}
+
 proc ::dbus::UnixDomainSocket args {
 	if {[llength $args] == 0} {
 		return -code error "Wrong # args:\
@@ -196,6 +420,9 @@ proc ::dbus::SafeGetLine {sock cmd} {
 		} elseif {$n == -1 && [eof $sock]} {
 			SockRaiseError $sock "unexpected remote disconnect"
 		} elseif {$n >= 0} {
+			# The channel is in binary mode, so the CR
+			# of the line terminator is still there:
+			regsub {\r$} $line "" line
 			eval [linsert $cmd end [encoding convertfrom ascii $line]]
 		}
 	}
@@ -211,75 +438,321 @@ proc ::dbus::AuthOnNextCommand {sock cmd} {
 	fileevent $sock readable [MyCmd SafeGetLine $sock $cmd]
 }
 
-# This is implementation is quite error-prone and slow,
-# and requires availability of the "id" Unix program in
-# the PATH.
+# Returns the effective UID of the process.
+# Falls back to running the "id" program (once) if ceptcl
+# is not available.
 proc ::dbus::UnixUID {} {
-	exec id -u
+	variable unix_uid
+
+	if {![info exists unix_uid]} {
+		if {![catch {package require ceptcl}]
+				&& [llength [info commands ::cep::geteuid]] > 0} {
+			set unix_uid [::cep::geteuid]
+		} else {
+			set unix_uid [exec id -u]
+		}
+	}
+	set unix_uid
 }
 
 proc ::dbus::SockRaiseError {sock error} {
 	variable $sock; upvar 0 $sock state
 
 	close $sock
-	set state(code)   error
-	set state(result) $error
+	if {[info exists state(callback)]} {
+		ClientConnectDone $sock error $error
+	} else {
+		set state(code)   error
+		set state(result) $error
+	}
 }
 
-proc ::dbus::ClientEndpoint {dests bus command mechs timeout async} {
-	# TODO implement iteration over all dests
-	foreach {transport spec} $dests break
+proc ::dbus::ClientEndpoint {dests bus command mechs timeout async opts} {
+	variable connect_results
 
-	switch -- $transport {
-		unix {
-			array set params $spec
-			if {[info exists params(path)]} {
-				set path $params(path)
-			} elseif {[info exists params(abstract)]} {
-				set path $params(abstract)
-			} else {
-				return -code error "Required address component missing: path or abstract"
-			}
-			set sock [UnixDomainSocket -async $path]
+	if {[string equal [lindex $dests 0] loopback]} {
+		if {[llength $dests] != 2} {
+			return -code error "Loopback address can't be combined with others"
 		}
-		tcp {
-			array set params $spec
-			foreach param {host port} {
-				if {![info exists params($param)]} {
-					return -code error "Required address component missing: $param"
+		set pair [LoopbackEndpoint $opts]
+		if {$async != ""} {
+			after 0 [linsert $async end ok $pair]
+			return
+		}
+		return $pair
+	}
+
+	if {$async != ""} {
+		ClientRaceStart $dests $bus $command $mechs $timeout $opts $async
+		return
+	}
+
+	set id [incr connect_results(id)]
+	ClientRaceStart $dests $bus $command $mechs $timeout $opts \
+		[MyCmd ClientEndpointDone $id]
+	vwait [namespace current]::connect_results($id)
+
+	foreach {code result} $connect_results($id) break
+	unset connect_results($id)
+	return -code $code $result
+}
+
+# Creates a pair of D-Bus channels connected back-to-back within
+# this process (the "loopback:" transport) and returns the list
+# of them, the client end first.
+# Both ends belong to this process, so no authentication is performed.
+proc ::dbus::LoopbackEndpoint opts {
+	package require ceptcl
+
+	set pair [cep -domain local]
+	foreach sock $pair {
+		fconfigure $sock -translation binary -buffering none -blocking no
+		ChanInit $sock $opts
+		set [namespace current]::${sock}(serial) 0
+		fileevent $sock readable [MyCmd ReadMessages $sock]
+	}
+	set pair
+}
+
+proc ::dbus::ClientEndpointDone {id code result} {
+	variable connect_results
+	set connect_results($id) [list $code $result]
+}
+
+# Starts connecting to the first server available from the list
+# of addresses $dests. The addresses are tried in order, but without
+# waiting for each attempt to complete: the next attempt is started
+# as soon as the previous one fails or after connect_stagger ms,
+# whichever happens first. The first connection to authenticate
+# successfully wins; the attempts still in progress are then aborted.
+# The outcome is reported to $callback as with ClientConnectAsync;
+# on failure, the error of the last attempt is reported.
+# Errors preventing any attempt from being started are raised right away.
+proc ::dbus::ClientRaceStart {dests bus command mechs timeout opts callback} {
+	variable races
+	set token race[incr races]
+	variable $token; upvar 0 $token race
+
+	set race(dests)    $dests
+	set race(params)   [list $bus $command $mechs $timeout $opts]
+	set race(callback) $callback
+	set race(attempts) 0
+	set race(live)     [list]
+	set race(error)    ""
+
+	ClientRaceNext $token
+	if {[llength $race(live)] == 0} {
+		set err $race(error)
+		unset race
+		return -code error $err
+	}
+	set token
+}
+
+# Starts the next connection attempt of the race $token.
+# Returns false if the race has run out of addresses.
+proc ::dbus::ClientRaceNext token {
+	variable connect_stagger
+	variable $token; upvar 0 $token race
+
+	if {[info exists race(timer)]} {
+		after cancel $race(timer)
+		unset race(timer)
+	}
+
+	while {[llength $race(dests)] > 0} {
+		set transport [Pop race(dests)]
+		set spec [Pop race(dests)]
+
+		# Kernel-provided credentials EXTERNAL relies upon are only
+		# available on Unix-domain sockets, so pipelined authentication
+		# is not attempted on other transports:
+		set pipeline [expr {[string equal $transport unix]
+			|| [string equal $transport seqpacket]}]
+
+		set n [incr race(attempts)]
+		set cmd [concat [list ClientConnectAsync $transport $spec] \
+			$race(params) [list $pipeline [MyCmd ClientRaceDone $token $n]]]
+		if {[catch {eval $cmd} sock]} {
+			set race(error) $sock
+			continue
+		}
+
+		set race(sock,$n) $sock
+		lappend race(live) $n
+		if {[llength $race(dests)] > 0} {
+			set race(timer) [after $connect_stagger [MyCmd ClientRaceNext $token]]
+		}
+		return 1
+	}
+
+	return 0
+}
+
+# Processes the outcome of the connection attempt $n of the race $token.
+# The code "retry" means the attempt continues on the channel $result.
+proc ::dbus::ClientRaceDone {token n code result} {
+	variable $token; upvar 0 $token race
+
+	switch -- $code {
+		retry {
+			set race(sock,$n) $result
+			return
+		}
+		ok {
+			foreach other $race(live) {
+				if {$other != $n} {
+					ClientConnectAbort $race(sock,$other)
 				}
 			}
-			set sock [socket -async $params(host) $params(port)]
 		}
 		default {
-			return -code error "Bad transport \"$transport\":\
-				must be unix or tcp"
+			set ix [lsearch -exact $race(live) $n]
+			set race(live) [lreplace $race(live) $ix $ix]
+			set race(error) $result
+			if {[ClientRaceNext $token] || [llength $race(live)] > 0} return
 		}
 	}
 
+	if {[info exists race(timer)]} {
+		after cancel $race(timer)
+	}
+	set cmd $race(callback)
+	unset race
+	uplevel #0 [linsert $cmd end $code $result]
+}
+
+# Aborts the connection attempt in progress on $sock.
+proc ::dbus::ClientConnectAbort sock {
+	variable reply_waiters
+	variable $sock; upvar 0 $sock state
+
+	after cancel [MyCmd ClientOnConnectTimeout $sock]
+	unset -nocomplain reply_waiters($sock,1)
+	close $sock
+	unset state
+}
+
+# Starts connecting to the server at the address $spec using
+# the transport $transport. Once the connection is authenticated
+# (or fails) the command $callback is called with two arguments
+# appended: the completion code (ok or error) and either the name
+# of the connected channel or the error message.
+# Errors detected before any I/O is started are raised right away.
+proc ::dbus::ClientConnectAsync {transport spec bus command mechs timeout opts pipeline callback} {
+	set sock [ClientConnect $transport $spec]
+
+	ChanInit $sock $opts
+
+	variable $sock; upvar 0 $sock state
+	set state(serial)   0
+	set state(callback) $callback
+	set state(connect)  [list $transport $spec $bus $command $mechs \
+		$timeout $opts]
+
 	if {$timeout > 0} {
 		after $timeout [MyCmd ClientOnConnectTimeout $sock]
 	}
-	fileevent $sock writable [MyCmd ClientOnConnectCompleted $sock $command $mechs]
+	fileevent $sock writable [MyCmd ClientOnConnectCompleted \
+		$sock $command $mechs $bus $pipeline]
 
-	vwait [namespace current]::${sock}(code)
+	set sock
+}
 
+# Completes the connection attempt on $sock, reporting its outcome
+# to the callback set up by ClientConnectAsync.
+# On failure the state of the channel is discarded.
+proc ::dbus::ClientConnectDone {sock code result} {
 	variable $sock; upvar 0 $sock state
-	set code $state(code)
-	set result $state(result)
+
+	after cancel [MyCmd ClientOnConnectTimeout $sock]
+
+	set cmd $state(callback)
 	if {[string equal $code ok]} {
-		set state(serial) 0
+		unset state(callback) state(connect)
 	} else {
 		unset state
 	}
-	return -code $code $result
+	uplevel #0 [linsert $cmd end $code $result]
+}
+
+# Retries the connection attempt on $sock (which has already been
+# closed) without pipelined authentication.
+# The callback is notified of the new channel with the code "retry".
+proc ::dbus::ClientConnectRetry sock {
+	variable reply_waiters
+	variable $sock; upvar 0 $sock state
+
+	after cancel [MyCmd ClientOnConnectTimeout $sock]
+	unset -nocomplain reply_waiters($sock,1)
+
+	set cmd $state(callback)
+	set args [concat $state(connect) 0 [list $cmd]]
+	unset state
+
+	if {[catch {eval ClientConnectAsync $args} result]} {
+		uplevel #0 [linsert $cmd end error $result]
+	} else {
+		uplevel #0 [linsert $cmd end retry $result]
+	}
 }
 
-proc ::dbus::ClientOnConnectCompleted {sock command mechs} {
+# Returns the cep domain to use for the tcp: address whose components
+# are stored in the array $paramsVar.
+proc ::dbus::InetDomain paramsVar {
+	upvar 1 $paramsVar params
+
+	if {[info exists params(family)]} {
+		if {[string equal $params(family) ipv6]} {
+			return inet6
+		}
+	} elseif {[info exists params(host)] && [string first : $params(host)] >= 0} {
+		return inet6
+	}
+	return inet
+}
+
+# Opens a connection to the server at the address $spec
+# using the transport $transport.
+proc ::dbus::ClientConnect {transport spec} {
+	switch -- $transport {
+		unix {
+			set sock [UnixDomainSocket -async [LocalSocketPath $spec]]
+		}
+		seqpacket {
+			set sock [UnixDomainSocket -type seqpacket -async \
+				[LocalSocketPath $spec]]
+		}
+		tcp {
+			array set params $spec
+			foreach param {host port} {
+				if {![info exists params($param)]} {
+					return -code error "Required address component missing: $param"
+				}
+			}
+			# Ceps are preferred as they can be written to with
+			# writev() and have their socket options tuned:
+			if {[catch {package require ceptcl}]} {
+				set sock [socket -async $params(host) $params(port)]
+			} else {
+				set sock [cep -domain [InetDomain params] -async \
+					$params(host) $params(port)]
+			}
+		}
+		default {
+			return -code error "Bad transport \"$transport\":\
+				must be unix, seqpacket or tcp"
+		}
+	}
+
+	set sock
+}
+
+proc ::dbus::ClientOnConnectCompleted {sock command mechs bus pipeline} {
 	set err [fconfigure $sock -error]
 	if {$err == ""} {
 		fileevent $sock writable {}
-		ClientAuthenticate $sock $command $mechs
+		ClientAuthenticate $sock $command $mechs $bus $pipeline
 	} else {
 		SockRaiseError $sock $err
 	}
@@ -289,10 +762,83 @@ proc ::dbus::ClientOnConnectTimeout sock {
 	SockRaiseError $sock "connection timed out"
 }
 
-proc ::dbus::ClientAuthenticate {sock command mechs} {
+proc ::dbus::ClientAuthenticate {sock command mechs bus pipeline} {
+	variable known_mechs
+	variable $sock; upvar 0 $sock state
+
 	fconfigure $sock -translation binary -buffering none -blocking no
-	AuthSendLine $sock \0AUTH
-	AuthOnNextCommand $sock [MyCmd ClientAuthProcessPeerMechs $sock $command $mechs]
+	set state(bus) $bus
+
+	if {$pipeline && [lsearch -exact $known_mechs EXTERNAL] >= 0
+			&& ([llength $mechs] == 0
+				|| [lsearch -exact $mechs EXTERNAL] >= 0)} {
+		ClientAuthPipelined $sock $command $mechs
+	} else {
+		AuthSendLine $sock \0AUTH
+		AuthOnNextCommand $sock [MyCmd ClientAuthProcessPeerMechs $sock $command $mechs]
+	}
+}
+
+# Authenticates using EXTERNAL without waiting for the server
+# at each step: the AUTH and BEGIN commands (followed by the Hello
+# call when connecting to a message bus) are sent in one write,
+# and then the server's response to AUTH is awaited.
+# On seqpacket sockets the Hello call has to be a packet of its own,
+# so it's sent separately.
+# If the server rejects the mechanism it will drop the connection
+# upon receiving BEGIN, so the client has to reconnect.
+proc ::dbus::ClientAuthPipelined {sock command mechs} {
+	variable $sock; upvar 0 $sock state
+
+	set data [encoding convertto ascii \
+		"\0AUTH EXTERNAL [AsciiToHex [UnixUID]]\r\nBEGIN\r\n"]
+	if {!$state(bus)} {
+		puts -nonewline $sock $data
+	} elseif {$state(packets)} {
+		puts -nonewline $sock $data
+		SendMessage $sock call [ClientHelloMessage $sock]
+	} else {
+		puts -nonewline $sock $data[join [ClientHelloMessage $sock] ""]
+	}
+
+	AuthOnNextCommand $sock [MyCmd ClientAuthProcessPipelined $sock $command $mechs]
+}
+
+proc ::dbus::ClientAuthProcessPipelined {sock command mechs line} {
+	switch -glob -- $line {
+		OK* {
+			set guid [ChopLeft $line "OK "]
+			ClientProcessAuthenticated $sock $guid 0
+		}
+		default {
+			# The server refused pipelined authentication;
+			# reconnect and negotiate the mechanism step by step:
+			close $sock
+			ClientConnectRetry $sock
+		}
+	}
+}
+
+# Marshals the Hello method call which must be the first message sent
+# to a message bus and arranges for its reply to be processed.
+# Returns the list of marshaled message chunks.
+proc ::dbus::ClientHelloMessage sock {
+	set serial [NextSerial $sock]
+	set fields [list \
+		[list 1 [list OBJECT_PATH {} /org/freedesktop/DBus]] \
+		[list 2 [list STRING {} org.freedesktop.DBus]] \
+		[list 3 [list STRING {} Hello]] \
+		[list 6 [list STRING {} org.freedesktop.DBus]]]
+	ExpectMethodReply $sock $serial 0 [MyCmd ClientProcessHello $sock]
+	MarshalMessage 1 0 $serial $fields {} {}
+}
+
+proc ::dbus::ClientProcessHello {sock status errorcode result} {
+	variable $sock; upvar 0 $sock state
+
+	if {[string equal $status ok] && [info exists state(outqlen)]} {
+		set state(name) [lindex $result 0]
+	}
 }
 
 # TODO algorythms for processing mechs should be more sophisticated:
@@ -430,55 +976,56 @@ proc ::dbus::ClientAuthCancelExchange {sock ctx mechs} {
 	AuthWaitFor REJECTED $sock $ctx $mechs
 }
 
-proc ::dbus::ClientProcessAuthenticated {sock guid} {
+# Completes the authentication handshake. $begin tells whether
+# the BEGIN command (and Hello) still have to be sent.
+proc ::dbus::ClientProcessAuthenticated {sock guid {begin 1}} {
 	variable $sock; upvar 0 $sock state
 
-	after cancel [MyCmd ClientOnConnectTimeout $sock]
-
-	AuthSendLine $sock BEGIN
+	if {$begin} {
+		AuthSendLine $sock BEGIN
+		if {$state(bus)} {
+			SendMessage $sock call [ClientHelloMessage $sock]
+		}
+	}
 	fconfigure $sock -translation binary
 	fileevent $sock readable [MyCmd ReadMessages $sock]
 
-	set state(code)   ok
-	set state(result) $sock
-	set state(guid)   $guid
+	set state(guid) $guid
 
 	puts "Auth OK, UUID: $guid"
-if 0 {
-	if {[info exists state(command)]} {
-		set cmd $state(command)
-		unset state
-		uplevel #0 [list $cmd $code $result]
-	} else {
-		set state(code)   $code
-		set state(result) $result
-	}
-}
+
+	ClientConnectDone $sock ok $sock
 }
 
 ### Server part:
 
-proc ::dbus::ServerEndpoint {dests bus command mechs timeout} {
+proc ::dbus::ServerEndpoint {dests bus command mechs timeout opts} {
 	foreach {transport spec} $dests break
 
 	switch -- $transport {
-		unix {
-			array set params $spec
-			if {[info exists params(path)]} {
-				set path $params(path)
-			} elseif {[info exists params(abstract)]} {
-				set path $params(abstract)
-			} else {
-				return -code error "Required address component missing: path or abstract"
+		unix -
+		seqpacket {
+			set cmd [list UnixDomainSocket -server \
+				[MyCmd ServerAcceptLocal $command $mechs $opts]]
+			if {[string equal $transport seqpacket]} {
+				lappend cmd -type seqpacket
 			}
-			set sock [UnixDomainSocket -server [MyCmd ServerAuthenticate $command $mechs] $path]
+			lappend cmd [LocalSocketPath $spec]
+			set sock [eval $cmd]
+			# Have connections accepted in non-blocking mode right away:
+			fconfigure $sock -blocking no
 		}
 		tcp {
 			array set params $spec
 			if {![info exists params(port)]} {
 					return -code error "Required address component missing: port"
 			}
-			set cmd [list socket -server [MyCmd ServerAuthenticate $command $mechs]]
+			set cmd [list -server [MyCmd ServerAuthenticate $command $mechs $opts]]
+			if {[catch {package require ceptcl}]} {
+				set cmd [linsert $cmd 0 socket]
+			} else {
+				set cmd [linsert $cmd 0 cep -domain [InetDomain params]]
+			}
 			if {[info exists params(host)]} {
 				lappend cmd -myaddr $params(host)
 			}
@@ -487,7 +1034,7 @@ proc ::dbus::ServerEndpoint {dests bus command mechs timeout} {
 		}
 		default {
 			return -code error "Bad transport \"$transport\":\
-				must be unix or tcp"
+				must be unix, seqpacket or tcp"
 		}
 	}
 
@@ -498,10 +1045,21 @@ proc ::dbus::ServerAuthWaitFor {what sock ctx mechs} {
 	AuthOnNextCommand $sock [MyCmd ServerAuthProcess$what $sock $ctx $mechs]
 }
 
-proc ::dbus::ServerAuthenticate {command mechs sock args} {
+# Accept callback for Unix-domain server sockets.
+# Records the effective UID of the peer process (obtained by ceptcl
+# from the kernel when accepting the connection) for use by
+# the EXTERNAL authentication mechanism.
+proc ::dbus::ServerAcceptLocal {command mechs opts sock addr peereid} {
+	variable $sock; upvar 0 $sock state
+	set state(peeruid) [lindex $peereid 0]
+	ServerAuthenticate $command $mechs $opts $sock $addr $peereid
+}
+
+proc ::dbus::ServerAuthenticate {command mechs opts sock args} {
 	variable known_mechs
 
 	fconfigure $sock -translation binary -buffering none -blocking no
+	ChanInit $sock $opts
 
 	if {[llength $mechs] > 0} {
 		set mechs [struct::set intersect $mechs $known_mechs]
@@ -536,6 +1094,8 @@ proc ::dbus::ServerAuthProcessAUTH {sock command mechs line} {
 			if {[lsearch -exact $mechs $mech] < 0} {
 				AuthSendLine $sock "REJECTED [join $mechs]"
 				ServerAuthWaitFor AUTH $sock $command $mechs
+			} elseif {[string equal $mech EXTERNAL]} {
+				ServerAuthExternal $sock $command $mechs $iresp
 			} else {
 				set ctx  [SASL::new -type server -mechanism $mech \
 					-callback [MyCmd $auth_callbacks($mech) $sock]]
@@ -585,6 +1145,66 @@ proc ::dbus::ServerAuthProcessDATA {sock ctx command mechs line} {
 	}
 }
 
+# Handles the EXTERNAL mechanism natively, without creating a SASL
+# context: the authorization identity claimed by the client in $iresp
+# (hex-encoded decimal UID) is checked against the credentials
+# of the peer recorded when its connection was accepted.
+# Connections without such credentials (TCP) are rejected.
+# An empty $iresp makes the server ask the client for the identity
+# with an empty DATA command.
+proc ::dbus::ServerAuthExternal {sock command mechs iresp} {
+	variable $sock; upvar 0 $sock state
+
+	if {$iresp == ""} {
+		AuthSendLine $sock DATA
+		ServerAuthWaitFor EXTERNAL $sock $command $mechs
+		return
+	}
+
+	if {[info exists state(peeruid)] && $state(peeruid) >= 0
+			&& [string is xdigit $iresp]
+			&& [string equal [HexToAscii $iresp] $state(peeruid)]} {
+		AuthSendLine $sock "OK [GenUUID]"
+		ServerAuthWaitFor BEGIN $sock $command $mechs
+	} else {
+		AuthSendLine $sock "REJECTED [join $mechs]"
+		ServerAuthWaitFor AUTH $sock $command $mechs
+	}
+}
+
+proc ::dbus::ServerAuthProcessEXTERNAL {sock command mechs line} {
+	switch -glob -- $line {
+		DATA -
+		{DATA *} {
+			# An empty identity stands for the one
+			# the peer has been authenticated as:
+			variable $sock; upvar 0 $sock state
+			set resp [string trim [ChopLeft $line DATA]]
+			if {$resp == "" && [info exists state(peeruid)]} {
+				set resp [AsciiToHex $state(peeruid)]
+			}
+			if {$resp == ""} {
+				AuthSendLine $sock "REJECTED [join $mechs]"
+				ServerAuthWaitFor AUTH $sock $command $mechs
+			} else {
+				ServerAuthExternal $sock $command $mechs $resp
+			}
+		}
+		BEGIN {
+			close $sock
+		}
+		CANCEL -
+		ERROR {
+			AuthSendLine $sock "REJECTED [join $mechs]"
+			ServerAuthWaitFor AUTH $sock $command $mechs
+		}
+		default {
+			AuthSendLine $sock ERROR
+			ServerAuthWaitFor EXTERNAL $sock $command $mechs
+		}
+	}
+}
+
 proc ::dbus::ServerAuthProcessBEGIN {sock command mechs line} {
 	switch -glob -- $line {
 		BEGIN {
@@ -614,18 +1234,13 @@ proc ::dbus::AuthCallbackExternal {sock command challenge args} {
 			return [UnixUID]
 		}
 		authenticate { # server part
-			# TODO this should be used only for UD-sockets.
-			# TCP sockets have no notion of peer IDs.
-			# This poses a problem regarding applicability
-			# of EXTERNAL to TCP sockets with its current
-			# semantics.
-			if 0 {
-			set supplied [HexToAscii $challenge]
-			set real [lindex [fconfigure $sock -peereid] 0]
-			return [expr {$real == $supplied}]
-			} else {
-				return 1
+			# TCP sockets have no notion of peer IDs,
+			# so only UD-sockets pass this check.
+			variable $sock; upvar 0 $sock state
+			if {![info exists state(peeruid)] || $state(peeruid) < 0} {
+				return 0
 			}
+			string equal [HexToAscii $challenge] $state(peeruid)
 		}
 		default {
 			return -code error "Unknown SASL EXTERNAL client callback command: \"$command\""
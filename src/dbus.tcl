@@ -10,8 +10,11 @@ namespace eval ::dbus {
 	source [file join $dir marshal.tcl]
 	source [file join $dir unmarshal.tcl]
 	source [file join $dir message.tcl]
+	source [file join $dir outqueue.tcl]
 	source [file join $dir dispatch.tcl]
+	source [file join $dir pool.tcl]
 	source [file join $dir iface.tcl]
+	source [file join $dir proxy.tcl]
 	unset dir
 }
 
@@ -3,6 +3,141 @@
 
 namespace eval ::dbus {
 	variable reply_waiters
+	# Handlers of incoming method calls and signals registered
+	# by [trap], indexed by channel, interface and member name:
+	variable traps
+	# Signals held back by handlers trapped with -coalesce, indexed
+	# by channel and the list of sender, object, interface and member:
+	variable held
+}
+
+# Complete incoming messages are not dispatched right from the reader.
+# Instead, they're appended to the per-connection incoming queue which
+# is drained from an idle callback.
+# Reading from the connection is suspended (its readable fileevent
+# is removed or its reader thread is paused) while the incoming queue
+# holds -maxqueued messages or -maxbuffered bytes or more, or the message
+# being read would take it past -maxbuffered bytes, and it's resumed
+# once the queue is drained, so a peer flooding us with messages faster
+# than we can process them is throttled by the transport. No message
+# may be larger than -maxbuffered bytes (see ProcessHeaderPrologue).
+# Message bodies are unmarshaled right before dispatching.
+# A single pass of the idle callback lasts about -latency milliseconds
+# at most: once they're spent, the rest of the queue is left for another
+# idle callback, so that the event loop (and Tk redraws in particular)
+# gets a chance to run in between. A huge body may take several passes
+# to unmarshal (see MessageDecode). Setting -latency to 0 removes
+# the limit.
+
+proc ::dbus::InQueueInit chan {
+	variable $chan; upvar 0 $chan state
+
+	set state(inq)       [list]
+	set state(inqlen)    0
+	set state(inflight)  0
+	set state(suspended) 0
+}
+
+proc ::dbus::QueueIncomingMessage {chan msgid} {
+	variable $chan; upvar 0 $chan state
+	variable $msgid; upvar 0 $msgid msg
+
+	lappend state(inq) $msgid
+	incr state(inqlen) $msg(size)
+	set state(inflight) 0
+	InQueueThrottle $chan
+
+	if {![info exists state(dispatchid)]} {
+		set state(dispatchid) [after idle [MyCmd InQueueDispatch $chan]]
+	}
+}
+
+proc ::dbus::InQueueDispatch chan {
+	variable $chan; upvar 0 $chan state
+
+	if {![info exists state(inq)]} return
+	unset -nocomplain state(dispatchid)
+
+	if {$state(latency) > 0} {
+		set deadline [expr {[clock clicks -milliseconds] + $state(latency)}]
+	} else {
+		set deadline 0
+	}
+
+	while {[llength $state(inq)] > 0} {
+		set msgid [lindex $state(inq) 0]
+		set size  [set ${msgid}(size)]
+		if {[SignalHold $chan $msgid]} {
+			set state(inq) [lreplace $state(inq) 0 0]
+			incr state(inqlen) -$size
+			continue
+		}
+		if {[catch {MessageDecode $msgid $deadline} done]} {
+			StreamTearDown $chan $done
+			return
+		}
+		if {!$done} break
+
+		set state(inq) [lreplace $state(inq) 0 0]
+		incr state(inqlen) -$size
+
+		DispatchIncomingMessage $chan $msgid
+
+		# The connection might have been torn down by the handler:
+		if {![info exists state(inq)]} return
+
+		if {$deadline > 0 && [clock clicks -milliseconds] >= $deadline} break
+	}
+
+	# Let the event loop run before dispatching the rest:
+	if {[llength $state(inq)] > 0} {
+		set state(dispatchid) [after idle [MyCmd InQueueDispatch $chan]]
+	}
+
+	InQueueThrottle $chan
+}
+
+# Suspends or resumes reading from $chan depending on whether
+# its incoming queue has reached any of the limits. The message being
+# read (of state(inflight) bytes) counts unless the queue is empty,
+# so that it can always be read in full once the queue is drained.
+proc ::dbus::InQueueThrottle chan {
+	variable $chan; upvar 0 $chan state
+
+	set full [expr {[llength $state(inq)] >= $state(maxqueued)
+		|| $state(inqlen) >= $state(maxbuffered)
+		|| ($state(inqlen) > 0
+			&& $state(inqlen) + $state(inflight) > $state(maxbuffered))}]
+
+	set thread [expr {[info exists state(reader)]
+		&& [string equal $state(reader) thread]}]
+	if {$full && !$state(suspended)} {
+		if {$thread} {
+			::cep::dbusreader pause $chan
+		} else {
+			fileevent $chan readable {}
+		}
+		set state(suspended) 1
+	} elseif {!$full && $state(suspended)} {
+		if {$thread} {
+			::cep::dbusreader resume $chan
+		} else {
+			fileevent $chan readable [MyCmd ChanAsyncRead $chan]
+		}
+		set state(suspended) 0
+	}
+}
+
+# Discards messages pending in the incoming queue of $chan.
+proc ::dbus::InQueueFree chan {
+	variable $chan; upvar 0 $chan state
+
+	if {[info exists state(dispatchid)]} {
+		after cancel $state(dispatchid)
+	}
+	foreach msgid $state(inq) {
+		MessageDelete $msgid
+	}
 }
 
 proc ::dbus::DispatchIncomingMessage {chan msgid} {
@@ -12,12 +147,14 @@ proc ::dbus::DispatchIncomingMessage {chan msgid} {
 
 	switch -- $msg(type) {
 		METHOD_CALL {
+			ProcessMethodCall $chan $msgid
 		}
 		METHOD_REPLY -
 		ERROR {
 			ProcessMethodReply $chan $msgid
 		}
 		SIGNAL {
+			ProcessSignal $chan $msgid
 		}
 		UNKNOWN {
 		}
@@ -26,6 +163,190 @@ proc ::dbus::DispatchIncomingMessage {chan msgid} {
 	MessageDelete $msgid
 }
 
+# Returns the handler entry registered with [trap] which matches
+# the message $msgid received on $chan or an empty string if none does.
+proc ::dbus::FindTrap {chan msgid} {
+	variable traps
+	variable $msgid; upvar 0 $msgid msg
+
+	foreach field {INTERFACE SENDER PATH SIGNATURE} {
+		if {[info exists msg($field)]} {
+			set $field $msg($field)
+		} else {
+			set $field ""
+		}
+	}
+	# Handlers for a specific interface take precedence:
+	set ifaces [list $INTERFACE]
+	if {$INTERFACE != ""} {
+		lappend ifaces ""
+	}
+	foreach iface $ifaces {
+		if {![info exists traps($chan,$iface,$msg(MEMBER))]} continue
+		foreach entry $traps($chan,$iface,$msg(MEMBER)) {
+			foreach {src obj sig mlist} $entry break
+			if {($src == "" || [string equal $src $SENDER])
+					&& ($obj == "" || [string equal $obj $PATH])
+					&& ($sig == "" || [string equal $mlist $SIGNATURE])} {
+				return $entry
+			}
+		}
+	}
+	return ""
+}
+
+# Returns the command calling the handler $command for the message
+# $msgid received on $chan.
+proc ::dbus::TrapCommand {chan msgid command} {
+	variable $msgid; upvar 0 $msgid msg
+
+	set info [list]
+	foreach {key field} {
+		sender SENDER serial serial object PATH interface INTERFACE member MEMBER
+	} {
+		if {[info exists msg($field)]} {
+			lappend info $key $msg($field)
+		} else {
+			lappend info $key ""
+		}
+	}
+	concat $command [list $chan $info] $msg(params)
+}
+
+# Calls the handler of the method call $msgid received on $chan
+# and arranges for its result to be sent back unless the caller
+# doesn't expect a reply.
+proc ::dbus::ProcessMethodCall {chan msgid} {
+	variable $msgid; upvar 0 $msgid msg
+
+	if {[info exists msg(SENDER)]} {
+		set sender $msg(SENDER)
+	} else {
+		set sender ""
+	}
+	set noreply [expr {$msg(flags) & 1}]
+
+	set entry [FindTrap $chan $msgid]
+	if {$entry == ""} {
+		if {!$noreply} {
+			fail $chan org.freedesktop.DBus.Error.UnknownMethod $msg(serial) \
+				-destination $sender -signature s -- \
+				"No handler for method \"$msg(MEMBER)\""
+		}
+		return
+	}
+	foreach {src obj sig mlist command out pool} $entry break
+
+	set cmd  [TrapCommand $chan $msgid $command]
+	set done [MyCmd MethodReturn $chan $msg(serial) $sender $out $noreply]
+	if {$pool != ""} {
+		# Calls from the same sender are handled in order:
+		PoolRun $pool $chan,$sender $cmd $done
+	} else {
+		global errorCode
+		if {[set code [catch {uplevel #0 $cmd} result]] == 1} {
+			set errorcode $errorCode
+		} else {
+			set errorcode NONE
+		}
+		eval $done [list $code $result $errorcode]
+	}
+}
+
+# Sends the reply to the method call $serial received on $chan from
+# $sender, given the completion code, result and error code of its handler.
+proc ::dbus::MethodReturn {chan serial sender out noreply code result errorcode} {
+	variable $chan; upvar 0 $chan state
+
+	# The connection might have gone while the call was handled:
+	if {$noreply || ![info exists state(outqlen)]} return
+
+	if {$code != 1} {
+		if {![catch {eval [list reply $chan $serial \
+				-destination $sender -signature $out --] $result} result]} {
+			return
+		}
+		set errorcode NONE
+	}
+	if {[string equal [lrange $errorcode 0 1] {DBUS METHOD_CALL}]} {
+		set name [lindex $errorcode 2]
+	} else {
+		set name org.freedesktop.DBus.Error.Failed
+	}
+	fail $chan $name $serial -destination $sender -signature s -- $result
+}
+
+# Calls the handler of the signal $msgid received on $chan, if any.
+proc ::dbus::ProcessSignal {chan msgid} {
+	set entry [FindTrap $chan $msgid]
+	if {$entry == ""} return
+
+	SafeCall uplevel #0 [TrapCommand $chan $msgid [lindex $entry 4]]
+}
+
+# Holds back the signal $msgid received on $chan if its handler was
+# trapped with -coalesce, replacing the one with the same sender, object,
+# interface and member held already, whose body is never unmarshaled.
+# The first signal held starts the window at the end of which the last
+# one is dispatched. Returns true if the signal has been held.
+proc ::dbus::SignalHold {chan msgid} {
+	variable held
+	variable $msgid; upvar 0 $msgid msg
+
+	if {![string equal $msg(type) SIGNAL]} {
+		return 0
+	}
+	set entry [FindTrap $chan $msgid]
+	if {$entry == "" || [lindex $entry 7] == 0} {
+		return 0
+	}
+
+	set key [list]
+	foreach field {SENDER PATH INTERFACE MEMBER} {
+		if {[info exists msg($field)]} {
+			lappend key $msg($field)
+		} else {
+			lappend key ""
+		}
+	}
+	upvar 0 held($chan,$key) slot
+	if {[info exists slot]} {
+		MessageDelete [lindex $slot 0]
+		lset slot 0 $msgid
+	} else {
+		set slot [list $msgid [after [lindex $entry 7] \
+			[MyCmd SignalRelease $chan $key]]]
+	}
+	return 1
+}
+
+# Dispatches the signal held under $key for $chan once its window is over.
+proc ::dbus::SignalRelease {chan key} {
+	variable held
+
+	set msgid [lindex $held($chan,$key) 0]
+	unset held($chan,$key)
+
+	if {[catch {MessageDecode $msgid 0} err]} {
+		MessageDelete $msgid
+		StreamTearDown $chan $err
+		return
+	}
+	DispatchIncomingMessage $chan $msgid
+}
+
+# Discards signals held back for $chan.
+proc ::dbus::SignalsFree chan {
+	variable held
+
+	foreach name [array names held $chan,*] {
+		foreach {msgid id} $held($name) break
+		after cancel $id
+		MessageDelete $msgid
+		unset held($name)
+	}
+}
+
 proc ::dbus::ExpectMethodReply {chan serial timeout command} {
 	variable reply_waiters
 
@@ -44,7 +365,7 @@ proc ::dbus::ProcessMethodReply {chan msgid} {
 
 	puts [info level 0]
 
-	set serial $msg(serial)
+	set serial $msg(REPLY_SERIAL)
 	set rvpoint reply_waiters($chan,$serial)
 	if {![info exists $rvpoint]} return
 
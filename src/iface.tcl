@@ -15,6 +15,7 @@ proc ::dbus::endpoint args {
 	set timeout 0
 	set command ""
 	set mechs [list]
+	set opts [list]
 
 	while {[llength $args] > 0} {
 		set opt [Pop args]
@@ -25,14 +26,31 @@ proc ::dbus::endpoint args {
 			-timeout { set timeout [Pop args] }
 			-command { set command [Pop args] }
 			-mechanisms { set mechs [Pop args] }
+			-coalesce   -
+			-weights    -
+			-starvation -
+			-maxmessage -
+			-maxbuffered -
+			-maxqueued  -
+			-sendbuffer -
+			-receivebuffer -
+			-nodelay    -
+			-cork       { lappend opts $opt [Pop args] }
 			default {
 				return -code error "Bad option \"$opt\":\
 					must be one of -bus, -server, -async, -timeout,\
-					-command or -mechanisms"
+					-command, -mechanisms, -coalesce, -weights,\
+					-starvation, -maxmessage, -maxbuffered,\
+					-maxqueued, -sendbuffer, -receivebuffer,\
+					-nodelay or -cork"
 			}
 		}
 	}
 
+	foreach {opt value} $opts {
+		ChanCheckOption $opt $value
+	}
+
 	if {$master && $async != ""} {
 		return -code error "Cannot use -async with -server"
 	}
@@ -58,12 +76,107 @@ proc ::dbus::endpoint args {
 	}
 
 	if {$master} {
-		ServerEndpoint $dests $bus $command $mechs $timeout
+		ServerEndpoint $dests $bus $command $mechs $timeout $opts
 	} else {
-		ClientEndpoint $dests $bus $command $mechs $timeout $async
+		ClientEndpoint $dests $bus $command $mechs $timeout $async $opts
+	}
+}
+
+# Queries or modifies per-connection options of the D-Bus channel $chan.
+# Without options returns a list of all options with their values,
+# with a single option returns its value, otherwise sets each option
+# to the value following it.
+proc ::dbus::configure {chan args} {
+	variable chan_options
+	variable sock_options
+	variable $chan; upvar 0 $chan state
+
+	if {![info exists state(outqlen)]} {
+		return -code error "\"$chan\" is not a D-Bus channel"
+	}
+
+	switch -- [llength $args] {
+		0 {
+			set out [list]
+			foreach opt [lsort [concat [array names chan_options] $sock_options]] {
+				if {[info exists chan_options($opt)]} {
+					lappend out $opt $state([string range $opt 1 end])
+				} elseif {![catch {fconfigure $chan $opt} value]} {
+					# Only those the channel supports:
+					lappend out $opt $value
+				}
+			}
+			return $out
+		}
+		1 {
+			set opt [lindex $args 0]
+			if {[lsearch -exact $sock_options $opt] >= 0} {
+				return [fconfigure $chan $opt]
+			}
+			if {![info exists chan_options($opt)]} {
+				ChanCheckOption $opt ""
+			}
+			return $state([string range $opt 1 end])
+		}
+	}
+
+	if {[llength $args] % 2 != 0} {
+		return -code error "wrong # args: should be\
+			\"[lindex [info level 0] 0] chan ?option? ?value option value ...?\""
+	}
+	foreach {opt value} $args {
+		ChanSetOption $chan $opt $value
+	}
+}
+
+# Writes out the messages waiting in the send queue of the D-Bus
+# channel $chan, then closes it and frees its state: calls still
+# awaiting replies fail. Closing the channel with [close] instead
+# discards the queued messages.
+proc ::dbus::disconnect chan {
+	variable $chan; upvar 0 $chan state
+
+	if {![info exists state(outqlen)]} {
+		return -code error "\"$chan\" is not a D-Bus channel"
+	}
+
+	global errorCode
+	if {[catch {OutQueueDrain $chan} err]} {
+		set code $errorCode
+	}
+	set reason "channel closed"
+	ChanFree $chan [list DBUS CLOSED $reason] $reason
+	if {[info exists code]} {
+		return -code error -errorcode $code $err
 	}
 }
 
+# Returns the number of messages waiting in the send queue of
+# the D-Bus channel $chan: either in the given $lane or in each
+# of the lanes (as a list of lane names and message counts).
+proc ::dbus::pending {chan {lane ""}} {
+	variable lanes
+	variable $chan; upvar 0 $chan state
+
+	if {![info exists state(outqlen)]} {
+		return -code error "\"$chan\" is not a D-Bus channel"
+	}
+
+	if {$lane != ""} {
+		if {[lsearch -exact $lanes $lane] < 0} {
+			return -code error "Bad lane \"$lane\":\
+				must be reply, call or signal"
+		}
+		return $state(depth,$lane)
+	}
+
+	set out [list]
+	foreach lane $lanes {
+		lappend out $lane $state(depth,$lane)
+	}
+	set out
+}
+
 proc ::dbus::invoke {chan object imethod args} {
 	set dest ""
 	set insig ""
@@ -72,6 +185,7 @@ proc ::dbus::invoke {chan object imethod args} {
 	set ignore 0
 	set noautostart 0
 	set timeout 0
+	set body ""
 
 	while {[string match -* [lindex $args 0]]} {
 		set opt [Pop args]
@@ -83,11 +197,12 @@ proc ::dbus::invoke {chan object imethod args} {
 			-ignoreresult { set ignore 1 }
 			-noautostart  { set noautostart 2 }
 			-timeout      { set timeout [Pop args] }
+			-body         { set body [Pop args] }
 			--            { break }
 			default {
 				return -code error "Bad option \"$opt\":\
 					must be one of -destination, -in, -out, -command, -ignoreresult,\
-					-noautostart or -timeout"
+					-noautostart, -timeout or -body"
 			}
 		}
 	}
@@ -95,6 +210,12 @@ proc ::dbus::invoke {chan object imethod args} {
 	if {$ignore && ($outsig != "" || $command != "")} {
 		return -code error "-ignoreresult contradicts -out and -command"
 	}
+	if {$body != ""} {
+		if {$insig != "" || [llength $args] > 0} {
+			return -code error "-body contradicts -in and arguments"
+		}
+		set insig [BodySignature $body]
+	}
 
 	if {![SplitMemberName $imethod iface member]} {
 		return -code error "Malformed interfaced method name: \"$imethod\""
@@ -110,24 +231,39 @@ proc ::dbus::invoke {chan object imethod args} {
 	set flags [expr {$ignore | $noautostart}]
 	set serial [NextSerial $chan]
 
-	set fields [list \
-		[list 1 [list OBJECT_PATH {} $object]] \
-		[list 2 [list STRING {} $iface]] \
-		[list 3 [list STRING {} $member]]]
+	set fields [MemberFields $object $iface $member $dest $insig]
+
+	SendMessage $chan call \
+		[MarshalMessage 1 $flags $serial $fields $mlist $args $body]
+
+	if {$ignore} return
+
+	AwaitMethodReply $chan $serial $timeout $command
+}
+
+# Returns the header fields of a method call or signal.
+proc ::dbus::MemberFields {object iface member dest sig} {
+	set fields [list [list 1 [list OBJECT_PATH {} $object]]]
+
+	if {$iface != ""} {
+		lappend fields [list 2 [list STRING {} $iface]]
+	}
+	lappend fields [list 3 [list STRING {} $member]]
 
 	if {$dest != ""} {
 		lappend fields [list 6 [list STRING {} $dest]]
 	}
-	if {$insig != ""} {
-		lappend fields [list 8 [list SIGNATURE {} $insig]]
-	}
-
-	foreach chunk [MarshalMessage 1 $flags $serial $fields $mlist $args] {
-		puts -nonewline $chan $chunk
+	if {$sig != ""} {
+		lappend fields [list 8 [list SIGNATURE {} $sig]]
 	}
 
-	if {$ignore} return
+	set fields
+}
 
+# Arranges for the reply to the method call $serial sent on $chan
+# to be passed to $command or, if it's empty, waits for the reply
+# and returns its outcome.
+proc ::dbus::AwaitMethodReply {chan serial timeout command} {
 	if {$command != ""} {
 		ExpectMethodReply $chan $serial $timeout $command
 		return
@@ -148,6 +284,7 @@ proc ::dbus::reply {chan replyserial args} {
 	set sig ""
 	set ignore 0
 	set noautostart 0
+	set body ""
 
 	while {[string match -* [lindex $args 0]]} {
 		set opt [Pop args]
@@ -157,15 +294,23 @@ proc ::dbus::reply {chan replyserial args} {
 			-signature    { set sig  [Pop args] }
 			-ignoreresult { set ignore 1 }
 			-noautostart  { set noautostart 2 }
+			-body         { set body [Pop args] }
 			--            { break }
 			default {
 				return -code error "Bad option \"$opt\":\
 					must be one of -destination, -object, -signature,\
-					-ignoreresult or -noautostart"
+					-ignoreresult, -noautostart or -body"
 			}
 		}
 	}
 
+	if {$body != ""} {
+		if {$sig != "" || [llength $args] > 0} {
+			return -code error "-body contradicts -signature and arguments"
+		}
+		set sig [BodySignature $body]
+	}
+
 	set flags [expr {$ignore | $noautostart}]
 	set serial [NextSerial $chan]
 
@@ -188,9 +333,8 @@ proc ::dbus::reply {chan replyserial args} {
 		set mlist [list]
 	}
 
-	foreach chunk [MarshalMessage 2 $flags $serial $fields $mlist $args] {
-		puts -nonewline $chan $chunk
-	}
+	SendMessage $chan reply \
+		[MarshalMessage 2 $flags $serial $fields $mlist $args $body]
 }
 
 proc ::dbus::fail {chan errorname replyserial args} {
@@ -199,6 +343,7 @@ proc ::dbus::fail {chan errorname replyserial args} {
 	set sig ""
 	set ignore 0
 	set noautostart 0
+	set body ""
 
 	while {[string match -* [lindex $args 0]]} {
 		set opt [Pop args]
@@ -208,15 +353,23 @@ proc ::dbus::fail {chan errorname replyserial args} {
 			-signature    { set sig  [Pop args] }
 			-ignoreresult { set ignore 1 }
 			-noautostart  { set noautostart 2 }
+			-body         { set body [Pop args] }
 			--            { break }
 			default {
 				return -code error "Bad option \"$opt\":\
 					must be one of -destination, -object, -signature,\
-					-ignoreresult or -noautostart"
+					-ignoreresult, -noautostart or -body"
 			}
 		}
 	}
 
+	if {$body != ""} {
+		if {$sig != "" || [llength $args] > 0} {
+			return -code error "-body contradicts -signature and arguments"
+		}
+		set sig [BodySignature $body]
+	}
+
 	set flags [expr {$ignore | $noautostart}]
 	set serial [NextSerial $chan]
 
@@ -240,9 +393,8 @@ proc ::dbus::fail {chan errorname replyserial args} {
 		set mlist [list]
 	}
 
-	foreach chunk [MarshalMessage 3 $flags $serial $fields $mlist $args] {
-		puts -nonewline $chan $chunk
-	}
+	SendMessage $chan reply \
+		[MarshalMessage 3 $flags $serial $fields $mlist $args $body]
 }
 
 proc ::dbus::emit {chan object imethod args} {
@@ -250,6 +402,7 @@ proc ::dbus::emit {chan object imethod args} {
 	set sig ""
 	set ignore 0
 	set noautostart 0
+	set body ""
 
 	while {[string match -* [lindex $args 0]]} {
 		set opt [Pop args]
@@ -258,15 +411,23 @@ proc ::dbus::emit {chan object imethod args} {
 			-signature    { set sig  [Pop args] }
 			-ignoreresult { set ignore 1 }
 			-noautostart  { set noautostart 2 }
+			-body         { set body [Pop args] }
 			--            { break }
 			default {
 				return -code error "Bad option \"$opt\":\
-					must be one of -destination, -signature, -ignoreresult\
-					or -noautostart"
+					must be one of -destination, -signature, -ignoreresult,\
+					-noautostart or -body"
 			}
 		}
 	}
 
+	if {$body != ""} {
+		if {$sig != "" || [llength $args] > 0} {
+			return -code error "-body contradicts -signature and arguments"
+		}
+		set sig [BodySignature $body]
+	}
+
 	if {![SplitMemberName $imethod iface member]} {
 		return -code error "Malformed interfaced method name: \"$imethod\""
 	}
@@ -281,37 +442,206 @@ proc ::dbus::emit {chan object imethod args} {
 	set flags [expr {$ignore | $noautostart}]
 	set serial [NextSerial $chan]
 
-	set fields [list \
-		[list 1 [list OBJECT_PATH {} $object]] \
-		[list 2 [list STRING {} $iface]] \
-		[list 3 [list STRING {} $member]]]
+	set fields [MemberFields $object $iface $member $dest $sig]
 
-	if {$dest != ""} {
-		lappend fields [list 6 [list STRING {} $dest]]
+	SendMessage $chan signal \
+		[MarshalMessage 4 $flags $serial $fields $mlist $args $body]
+}
+
+# Returns the arguments $args marshaled according to the signature $sig
+# as a message body, which can be passed with -body to invoke, emit,
+# reply, fail and send any number of times instead of the arguments.
+proc ::dbus::body {sig args} {
+	if {[catch {SigParseCached $sig} err]} {
+		return -code error "Bad signature: $err"
 	}
-	if {$sig != ""} {
-		lappend fields [list 8 [list SIGNATURE {} $sig]]
+	MarshalBody $sig $args
+}
+
+# Prepares a template for method calls (when $kind is "invoke") or
+# signals (when it's "emit") named $imethod on $object, taking the same
+# options as the respective command, less those of "invoke" concerning
+# the reply. The header of the messages is marshaled only once, here;
+# "send" then only marshals the serial number and the body of each.
+# Returns the name of the template, a variable which can be unset once
+# no longer needed.
+proc ::dbus::prepare {kind object imethod args} {
+	foreach {dest sig mlist iface member ignore flags} \
+		[PrepareParse $kind $imethod $args] break
+
+	set fields [MemberFields $object $iface $member $dest $sig]
+	if {$kind == "invoke"} {
+		set tmpl [TemplateCreate 1 $flags $fields $mlist]
+		set ${tmpl}(lane)  call
+		set ${tmpl}(reply) [expr {!$ignore}]
+	} else {
+		set tmpl [TemplateCreate 4 $flags $fields $mlist]
+		set ${tmpl}(lane)  signal
+		set ${tmpl}(reply) 0
 	}
+	set ${tmpl}(sig) $sig
+
+	set tmpl
+}
+
+# Checks the arguments of "prepare" following the object, $imethod and
+# the options $argv, and returns the destination, the signature and its
+# parsed form, the interface and member names, whether the reply is
+# ignored and the flags of the messages.
+proc ::dbus::PrepareParse {kind imethod argv} {
+	set dest ""
+	set sig ""
+	set ignore 0
+	set noautostart 0
 
-	foreach chunk [MarshalMessage 4 $flags $serial $fields $mlist $args] {
-		puts -nonewline $chan $chunk
+	switch -- $kind {
+		invoke  { set sigopt -in }
+		emit    { set sigopt -signature }
+		default {
+			return -code error "Bad message kind \"$kind\":\
+				must be invoke or emit"
+		}
 	}
+
+	while {[llength $argv] > 0} {
+		set opt [Pop argv]
+		switch -- $opt {
+			-destination  { set dest [Pop argv] }
+			-in           -
+			-signature    {
+				if {![string equal $opt $sigopt]} {
+					return -code error "Bad option \"$opt\":\
+						must be one of -destination, $sigopt, -ignoreresult\
+						or -noautostart"
+				}
+				set sig [Pop argv]
+			}
+			-ignoreresult { set ignore 1 }
+			-noautostart  { set noautostart 2 }
+			default {
+				return -code error "Bad option \"$opt\":\
+					must be one of -destination, $sigopt, -ignoreresult\
+					or -noautostart"
+			}
+		}
+	}
+
+	if {![SplitMemberName $imethod iface member]} {
+		return -code error "Malformed interfaced method name: \"$imethod\""
+	}
+	if {$kind == "emit" && $iface == ""} {
+		return -code error "No interface name provided"
+	}
+
+	if {[catch {SigParseCached $sig} mlist]} {
+		return -code error "Bad signature: $mlist"
+	}
+
+	list $dest $sig $mlist $iface $member $ignore \
+		[expr {$ignore | $noautostart}]
+}
+
+# Sends on $chan a message made from the template $tmpl returned by
+# "prepare" with the arguments $args or the body given with -body,
+# which must have the signature of the template. For method calls
+# expecting a reply, -command and -timeout have the same meaning as
+# for "invoke".
+proc ::dbus::send {chan tmpl args} {
+	variable $tmpl; upvar 0 $tmpl state
+
+	set command ""
+	set timeout 0
+	set body ""
+
+	while {[string match -* [lindex $args 0]]} {
+		set opt [Pop args]
+		switch -- $opt {
+			-command { set command [Pop args] }
+			-timeout { set timeout [Pop args] }
+			-body    { set body [Pop args] }
+			--       { break }
+			default {
+				return -code error "Bad option \"$opt\":\
+					must be one of -command, -timeout or -body"
+			}
+		}
+	}
+
+	if {![TemplateExists $tmpl]} {
+		return -code error "\"$tmpl\" is not a message template"
+	}
+	if {!$state(reply) && ($command != "" || $timeout != 0)} {
+		return -code error "-command and -timeout only apply to method calls\
+			expecting a reply"
+	}
+	if {$body != ""} {
+		if {[llength $args] > 0} {
+			return -code error "-body contradicts arguments"
+		}
+		set sig [BodySignature $body]
+		if {![string equal $sig $state(sig)]} {
+			return -code error "Body signature \"$sig\" doesn't match\
+				signature \"$state(sig)\" of the template"
+		}
+	}
+
+	TemplateSend $chan $tmpl $args $body $timeout $command
+}
+
+# Sends on $chan a message made from the template $tmpl with the body
+# $params or $body and, for method calls expecting a reply, awaits it
+# as "invoke" does.
+proc ::dbus::TemplateSend {chan tmpl params body timeout command} {
+	variable $tmpl; upvar 0 $tmpl state
+
+	set serial [NextSerial $chan]
+	SendMessage $chan $state(lane) [TemplateMarshal $tmpl $serial $params $body]
+
+	if {!$state(reply)} return
+
+	AwaitMethodReply $chan $serial $timeout $command
 }
 
+# Registers $command as the handler of method calls and signals named
+# $imethod received on $chan; the interface part of $imethod may be
+# omitted to match any interface. The handler can be restricted to
+# messages sent by a given -source, to a given -object or carrying
+# arguments of a given -signature. An empty $command removes the handler
+# registered with the same name and restrictions.
+# The handler is called with $chan, a list of keys and values describing
+# the message (sender, serial, object, interface and member) and the
+# arguments of the message appended. For a method call, it's expected
+# to return the list of values to reply with, marshaled according to
+# the -out signature; an error is sent back as an error reply, named
+# after the third element of its error code if it's {DBUS METHOD_CALL name}.
+# With -pool, method calls are handled in a thread of the given worker
+# pool (see pool.tcl) rather than in the current one.
+# With -coalesce, signals are held for the given number of milliseconds,
+# and only the last one with the same sender, object, interface and
+# member received meanwhile is passed to the handler.
 proc ::dbus::trap {chan imethod command args} {
+	variable traps
+
 	set src ""
 	set sig ""
 	set obj ""
+	set out ""
+	set pool ""
+	set window 0
 
 	while {[llength $args] > 0} {
 		set opt [Pop args]
 		switch -- $opt {
-			-source    { set src [Pop args] }
-			-signature { set sig [Pop args] }
-			-object    { set obj [Pop args] }
+			-source    { set src  [Pop args] }
+			-signature { set sig  [Pop args] }
+			-object    { set obj  [Pop args] }
+			-out       { set out  [Pop args] }
+			-pool      { set pool [Pop args] }
+			-coalesce  { set window [Pop args] }
 			default {
 				return -code error "Bad option \"$opt\":\
-					must be one of -source, -signature or -object"
+					must be one of -source, -signature, -object, -out,\
+					-pool or -coalesce"
 			}
 		}
 	}
@@ -323,10 +653,49 @@ proc ::dbus::trap {chan imethod command args} {
 	if {[catch {SigParseCached $sig} mlist]} {
 		return -code error "Bad input signature: $mlist"
 	}
+	if {[catch {SigParseCached $out} err]} {
+		return -code error "Bad output signature: $err"
+	}
+	if {$pool != "" && ![PoolExists $pool]} {
+		return -code error "\"$pool\" is not a worker pool"
+	}
+	if {![string is integer -strict $window] || $window < 0} {
+		return -code error "Bad value for -coalesce \"$window\":\
+			must be a non-negative integer"
+	}
 
-	# TODO register the trap
+	# Handlers are looked up by interface and member name, then
+	# the restrictions of each of those found are checked in turn:
+	upvar 0 traps($chan,$iface,$member) entries
+	set entry [list $src $obj $sig $mlist $command $out $pool $window]
+	set keep [list]
+	if {[info exists entries]} {
+		foreach item $entries {
+			if {![string equal [lrange $item 0 2] [lrange $entry 0 2]]} {
+				lappend keep $item
+			}
+		}
+	}
+	if {$command != ""} {
+		lappend keep $entry
+	}
+	if {[llength $keep] > 0} {
+		set entries $keep
+	} else {
+		unset -nocomplain entries
+	}
+	return
 }
 
+# Creates the command $name calling the method $imethod with arguments
+# marshaled according to $signature. Unless fixed with -destination and
+# -object, the destination and the object are taken by the command after
+# the channel, then the arguments follow. The header and the codec of the
+# calls are prepared once (per destination and object), so a call costs
+# only the marshaling of its arguments. The command returns the reply
+# unless -ignoreresult is given or the reply is passed to a -command.
+# With both -destination and -object, the command has a template of its
+# own, freed along with it; otherwise, it shares those of ProxyTemplate.
 proc ::dbus::remoteproc {name imethod signature args} {
 	if {![string match ::* $name]} {
 		set ns [uplevel 1 namespace current]
@@ -340,56 +709,103 @@ proc ::dbus::remoteproc {name imethod signature args} {
 		return -code error  "Command name \"$name\" already exists"
 	}
 
-	if {![SplitMethodName $imethod iface method]} {
-		return -code error "Bad method name \"$imethod\""
-	}
-	SigParseCached $signature ;# validate and cache
-
 	set dest ""
 	set obj  ""
-	foreach {opt val} $args {
+	set command ""
+	set timeout 0
+	set opts [list]
+	set fixdest 0
+	set fixobj  0
+	while {[llength $args] > 0} {
+		set opt [Pop args]
 		switch -- $opt {
-			-destination { set dest $val }
-			-object      { set obj  $val }
-			default      {
+			-destination  { set dest [Pop args]; set fixdest 1 }
+			-object       { set obj  [Pop args]; set fixobj  1 }
+			-command      { set command [Pop args] }
+			-timeout      { set timeout [Pop args] }
+			-ignoreresult -
+			-noautostart  { lappend opts $opt }
+			default {
 				return -code error "Bad option \"$opt\":\
-					must be one of -destination or -object"
+					must be one of -destination, -object, -command, -timeout,\
+					-ignoreresult or -noautostart"
 			}
 		}
 	}
 
+	if {[lsearch -exact $opts -ignoreresult] >= 0 && $command != ""} {
+		return -code error "-ignoreresult contradicts -command"
+	}
+
+	# Validate the method name, signature and options:
+	set spec [concat [list $imethod -in $signature] $opts]
+	PrepareParse invoke $imethod [lrange $spec 1 end]
+
 	set params chan
-	if {$dest == ""} {
+	set owned ""
+	if {$fixdest && $fixobj} {
+		set owned [eval [list prepare invoke $obj] $spec \
+			[list -destination $dest]]
+		set tmpl [list $owned]
+	}
+	if {$fixdest} {
+		set dest [list $dest]
+	} else {
 		lappend params destination
 		set dest \$destination
 	}
-	if {$obj  == ""} {
+	if {$fixobj} {
+		set obj [list $obj]
+	} else {
 		lappend params object
 		set obj \$object
 	}
 	lappend params args
 
-	if 0 {
-	proc $name $params [string map [list \
-			@dest      $dest \
-			@obj       $obj \
-			@iface     $iface \
-			@method    $method \
-			@signature $signature] {
-		::dbus::Invoke $chan @dest @obj @iface @method @signature $args
-	}]
-	}
-
-	append body ::dbus::Invoke " " \$chan
-	foreach item {dest obj iface method signature} {
-		if {[set $item] != ""} {
-			append body " " [set $item]
-		} else {
-			append body " " {{}}
-		}
+	if {!$fixdest || !$fixobj} {
+		set tmpl "\[::dbus::ProxyTemplate [list $spec] $dest $obj\]"
 	}
-	append body " " \$args
 
-	proc $name $params $body
+	proc $name $params [format {::dbus::TemplateSend $chan %s $args {} %s %s} \
+		$tmpl [list $timeout] [list $command]]
+	if {$owned != ""} {
+		trace add command $name delete [list ::dbus::TemplateFree $owned]
+	}
+}
+
+# Returns the template of method calls to $dest on $obj described by
+# $spec, the arguments of "prepare invoke" following the object, creating
+# it on first use. Once proxies_max templates are kept, the least recently
+# used half of them is freed before another one is created.
+proc ::dbus::ProxyTemplate {spec dest obj} {
+	variable proxies
+	variable proxies_used
+	variable proxies_tick
+	variable proxies_max
+
+	set key [list $spec $dest $obj]
+	if {![info exists proxies($key)]} {
+		if {[array size proxies] >= $proxies_max} {
+			ProxyTemplateTrim [expr {$proxies_max / 2}]
+		}
+		set proxies($key) [eval [list prepare invoke $obj] $spec \
+			[list -destination $dest]]
+	}
+	set proxies_used($key) [incr proxies_tick]
+	set proxies($key)
 }
 
+# Frees the templates of ProxyTemplate but the $n most recently used.
+proc ::dbus::ProxyTemplateTrim n {
+	variable proxies
+	variable proxies_used
+
+	set used [list]
+	foreach {key tick} [array get proxies_used] {
+		lappend used [list $tick $key]
+	}
+	foreach item [lrange [lsort -integer -index 0 $used] 0 end-$n] {
+		set key [lindex $item 1]
+		unset $proxies($key) proxies($key) proxies_used($key)
+	}
+}
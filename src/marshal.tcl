@@ -367,12 +367,26 @@ namespace eval ::dbus {
 
 proc ::dbus::MarshalHeader {outVar lenVar type flags msglen serial fields} {
 	upvar 1 $outVar out $lenVar len
+
+	MarshalHeaderFields out len $fields
+	set out [linsert $out 0 [MarshalHeaderPrologue $type $flags $msglen $serial]]
+}
+
+# Returns the fixed 12-byte part of a message header.
+proc ::dbus::MarshalHeaderPrologue {type flags msglen serial} {
 	variable bytesex
 	variable proto_major
 
-	set head [binary format acccii $bytesex $type $flags $proto_major $msglen $serial]
+	binary format acccii $bytesex $type $flags $proto_major $msglen $serial
+}
+
+# Marshals the array of header fields $fields, which follows the fixed
+# part of the header, and the padding ending the header. They don't
+# depend on the rest of the message, so the result can be reused.
+proc ::dbus::MarshalHeaderFields {outVar lenVar fields} {
+	upvar 1 $outVar out $lenVar len
 
-	set out [list $head]
+	set out [list]
 	set len 12
 	MarshalArray out len {1 STRUCT {BYTE {} VARIANT {}}} $fields
 
@@ -381,11 +395,15 @@ proc ::dbus::MarshalHeader {outVar lenVar type flags msglen serial fields} {
 	incr len [string length $pad]
 }
 
-proc ::dbus::MarshalMessage {type flags serial fields mlist params} {
+# The body of the message is either $params marshaled according to $mlist
+# or, if $body isn't empty, the body $body pre-marshaled by MarshalBody.
+proc ::dbus::MarshalMessage {type flags serial fields mlist params {body ""}} {
 	set msg [list]
 	set msglen 0
 
-	if {$mlist != ""} {
+	if {$body != ""} {
+		foreach {sig msglen msg} $body break
+	} elseif {$mlist != ""} {
 		MarshalList msg msglen $mlist $params
 	}
 
@@ -398,3 +416,28 @@ proc ::dbus::MarshalMessage {type flags serial fields mlist params} {
 	concat $header $msg
 }
 
+# Marshals $params according to the signature $sig into a message body
+# which can be sent any number of times. Since the body starts on an
+# 8-byte boundary in each message, it doesn't depend on the header.
+# The result is a list of the signature, the length of the body and
+# the list of its chunks.
+proc ::dbus::MarshalBody {sig params} {
+	set mlist [SigParseCached $sig]
+
+	set msg [list]
+	set msglen 0
+	if {$mlist != ""} {
+		MarshalList msg msglen $mlist $params
+	}
+
+	list $sig $msglen $msg
+}
+
+# Returns the signature of the pre-marshaled message body $body.
+proc ::dbus::BodySignature body {
+	if {[catch {llength $body} len] || $len != 3
+			|| ![string is integer -strict [lindex $body 1]]} {
+		return -code error "Malformed message body"
+	}
+	lindex $body 0
+}
@@ -3,6 +3,15 @@
 
 namespace eval ::dbus {
 	variable msgid 0
+	variable tmplid 0
+	# Templates of the calls made by commands created with [remoteproc]
+	# taking the destination or the object, indexed by the method
+	# description, destination and object, along with when each was
+	# last used; at most proxies_max of them are kept:
+	variable proxies
+	variable proxies_used
+	variable proxies_tick 0
+	variable proxies_max  256
 }
 
 proc ::dbus::MessageCreate {} {
@@ -18,7 +27,62 @@ proc ::dbus::MessageCreate {} {
 }
 
 proc ::dbus::MessageDelete name {
+	unset -nocomplain $name
+}
+
+# Creates a template for messages of the given $type and $flags having
+# the header fields $fields and bodies marshaled according to $mlist.
+# The header fields are marshaled here once and for all, only the fixed
+# part of the header and the body are marshaled for each message.
+proc ::dbus::TemplateCreate {type flags fields mlist} {
+	variable tmplid
+
+	set name [namespace current]::tmpl$tmplid
+	variable $name; upvar 0 $name tmpl
+
+	incr tmplid
+
+	MarshalHeaderFields header len $fields
+	set tmpl(type)   $type
+	set tmpl(flags)  $flags
+	set tmpl(mlist)  $mlist
+	set tmpl(header) $header
+	set tmpl(hlen)   $len
+
+	set name
+}
+
+# Frees the template $name; further arguments are ignored, so that
+# it can serve as a command delete trace.
+proc ::dbus::TemplateFree {name args} {
+	unset -nocomplain $name
+}
+
+proc ::dbus::TemplateExists name {
 	variable $name
-	unset name
+	info exists ${name}(header)
+}
+
+# Returns the list of chunks of the message made from the template $name
+# with the serial $serial and the body $params or, if $body isn't empty,
+# the pre-marshaled body $body.
+proc ::dbus::TemplateMarshal {name serial params {body ""}} {
+	variable $name; upvar 0 $name tmpl
+
+	set msg [list]
+	set msglen 0
+
+	if {$body != ""} {
+		foreach {sig msglen msg} $body break
+	} elseif {$tmpl(mlist) != ""} {
+		MarshalList msg msglen $tmpl(mlist) $params
+	}
+
+	if {$tmpl(hlen) + $msglen > 0x08000000} {
+		return -code error "Message data size exceeds limit"
+	}
+
+	concat [list [MarshalHeaderPrologue $tmpl(type) $tmpl(flags) \
+		$msglen $serial]] $tmpl(header) $msg
 }
 
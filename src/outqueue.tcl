@@ -0,0 +1,310 @@
+# $Id$
+# Queueing and coalescing of outgoing messages.
+
+# Outgoing messages are not written to the channel right away.
+# Instead, their marshaled chunks are accumulated in the per-connection
+# send queue which is written out in one go once per event loop
+# iteration (from an idle callback) or as soon as its size reaches
+# the threshold set by the -coalesce connection option, whichever
+# happens first. Hence a burst of messages sent from one event handler
+# costs a single write (or a few of them for large bursts).
+# Setting -coalesce to 0 makes each message be written out as soon
+# as it's queued, which suits latency-sensitive links.
+# On ceps, the chunks of the messages are handed to the system
+# with a single writev() call instead, without being copied into
+# the channel buffer first; what the system doesn't take at once
+# is kept aside and written out before anything else.
+# On seqpacket channels each message is sent as a packet of its own,
+# and -coalesce only bounds the amount sent in one go.
+
+# The send queue is split into priority lanes:
+# * "reply" holds method replies and errors;
+# * "call" holds method calls;
+# * "signal" holds signals.
+# Lanes are served in weighted round-robin fashion, in the order listed,
+# using weights set by the -weights connection option; a lane with zero
+# weight is only served when all other lanes are empty.
+# A non-empty lane which has been passed over while -starvation messages
+# were written from other lanes is served next regardless of weights.
+# At most -coalesce bytes (but at least one message) are handed to
+# the channel at once; while the channel has unwritten data the rest
+# of the queue is held back, so that messages from higher-priority lanes
+# queued meanwhile can still jump ahead of it.
+# Since messages wait in the queue rather than in the channel buffer,
+# a plain [close] of the channel discards them; [disconnect] writes
+# them out first.
+
+namespace eval ::dbus {
+	variable lanes {reply call signal}
+}
+
+if {[package vsatisfies $::tcl_version 8.5]} {
+	proc ::dbus::ChanPendingOutput chan {
+		chan pending output $chan
+	}
+} else {
+	proc ::dbus::ChanPendingOutput chan {
+		return 0
+	}
+}
+
+proc ::dbus::OutQueueInit chan {
+	variable lanes
+	variable $chan; upvar 0 $chan state
+
+	foreach lane $lanes {
+		set state(outq,$lane)   [list]
+		set state(depth,$lane)  0
+		set state(credit,$lane) 0
+		set state(starve,$lane) 0
+	}
+	set state(outqlen) 0
+}
+
+# Appends the list of marshaled message chunks $chunks to the lane $lane
+# of the send queue of $chan and either flushes the queue or schedules
+# its flushing.
+proc ::dbus::SendMessage {chan lane chunks} {
+	variable $chan; upvar 0 $chan state
+
+	if {![info exists state(outqlen)]} {
+		ChanInit $chan {}
+	}
+
+	set len 0
+	foreach chunk $chunks {
+		incr len [string length $chunk]
+	}
+	lappend state(outq,$lane) $chunks
+	incr state(depth,$lane)
+	incr state(outqlen) $len
+
+	if {$state(outqlen) >= $state(coalesce)} {
+		OutQueueFlush $chan
+	} elseif {![info exists state(flushid)]} {
+		set state(flushid) [after idle [MyCmd OutQueueFlush $chan]]
+	}
+}
+
+# Returns the name of the lane of the send queue of $chan
+# the next message should be taken from.
+# The send queue must not be empty.
+proc ::dbus::OutQueueNextLane chan {
+	variable lanes
+	variable $chan; upvar 0 $chan state
+
+	set next ""
+	foreach lane $lanes {
+		if {$state(depth,$lane) > 0 && $state(starve,$lane) >= $state(starvation)} {
+			set next $lane
+			break
+		}
+	}
+	if {$next == ""} {
+		foreach pass {1 2} {
+			foreach lane $lanes {
+				if {$state(depth,$lane) > 0 && $state(credit,$lane) > 0} {
+					set next $lane
+					break
+				}
+			}
+			if {$next != ""} break
+			# All non-empty lanes have used up their credits:
+			foreach lane $lanes {
+				set state(credit,$lane) $state(weight,$lane)
+			}
+		}
+	}
+	if {$next == ""} {
+		# Only lanes with zero weight have messages queued:
+		foreach lane $lanes {
+			if {$state(depth,$lane) > 0} {
+				set next $lane
+				break
+			}
+		}
+	}
+
+	foreach lane $lanes {
+		if {[string equal $lane $next]} {
+			set state(starve,$lane) 0
+		} elseif {$state(depth,$lane) > 0} {
+			incr state(starve,$lane)
+		}
+	}
+	if {$state(credit,$next) > 0} {
+		incr state(credit,$next) -1
+	}
+
+	set next
+}
+
+# Writes out a batch of messages from the send queue of $chan.
+proc ::dbus::OutQueueFlush chan {
+	variable $chan; upvar 0 $chan state
+
+	# The channel might have been torn down while
+	# the idle callback was pending:
+	if {![info exists state(outqlen)]} return
+
+	if {[info exists state(flushid)]} {
+		after cancel $state(flushid)
+		unset state(flushid)
+	}
+
+	# ... or closed with a plain [close], which discards the queue:
+	if {[llength [file channels $chan]] == 0} {
+		set reason "channel closed"
+		ChanFree $chan [list DBUS CLOSED $reason] $reason
+		return
+	}
+
+	# If the channel still has unwritten data, hold the queue back
+	# until it's drained:
+	if {[info exists state(unsent)]} {
+		if {![OutQueueWritev $chan $state(unsent)]} {
+			fileevent $chan writable [MyCmd OutQueueFlush $chan]
+			return
+		}
+		fileevent $chan writable {}
+	}
+
+	if {$state(outqlen) == 0} return
+
+	if {[ChanPendingOutput $chan] > 0} {
+		fileevent $chan writable [MyCmd OutQueueFlush $chan]
+		return
+	}
+
+	if {$state(packets)} {
+		OutQueueSendPackets $chan
+	} elseif {$state(writev)} {
+		# The messages only leave the queue once they're written:
+		set saved [OutQueueSave $chan]
+		set chunks [list]
+		set len 0
+		while {$state(outqlen) > 0} {
+			set lane [OutQueueNextLane $chan]
+			set msg [lindex $state(outq,$lane) 0]
+			set state(outq,$lane) [lreplace $state(outq,$lane) 0 0]
+			incr state(depth,$lane) -1
+			foreach chunk $msg {
+				incr len [string length $chunk]
+				incr state(outqlen) -[string length $chunk]
+			}
+			eval [list lappend chunks] $msg
+			if {$len >= $state(coalesce)} break
+		}
+
+		if {[catch {OutQueueWritev $chan $chunks} err]} {
+			global errorInfo errorCode
+			set info $errorInfo
+			set code $errorCode
+			OutQueueRestore $chan $saved
+			return -code error -errorinfo $info -errorcode $code $err
+		}
+	} else {
+		set data ""
+		while {$state(outqlen) > 0} {
+			set lane [OutQueueNextLane $chan]
+			set msg [join [lindex $state(outq,$lane) 0] ""]
+			set state(outq,$lane) [lreplace $state(outq,$lane) 0 0]
+			incr state(depth,$lane) -1
+			incr state(outqlen) -[string length $msg]
+			append data $msg
+			if {[string length $data] >= $state(coalesce)} break
+		}
+
+		puts -nonewline $chan $data
+	}
+
+	if {$state(outqlen) > 0 || [info exists state(unsent)]} {
+		fileevent $chan writable [MyCmd OutQueueFlush $chan]
+	} else {
+		fileevent $chan writable {}
+	}
+}
+
+# Returns the part of the state of the send queue of $chan which
+# taking messages from it changes, so that OutQueueRestore can put
+# them back if they can't be written after all.
+proc ::dbus::OutQueueSave chan {
+	variable $chan; upvar 0 $chan state
+
+	concat [array get state outq,*] [array get state depth,*] \
+		[array get state credit,*] [array get state starve,*] \
+		[list outqlen $state(outqlen)]
+}
+
+proc ::dbus::OutQueueRestore {chan saved} {
+	variable $chan; upvar 0 $chan state
+
+	array set state $saved
+}
+
+# Writes out everything queued for sending on $chan, blocking until
+# it's done.
+proc ::dbus::OutQueueDrain chan {
+	variable $chan; upvar 0 $chan state
+
+	fconfigure $chan -blocking yes
+	while {$state(outqlen) > 0 || [info exists state(unsent)]} {
+		flush $chan
+		OutQueueFlush $chan
+	}
+	flush $chan
+	fileevent $chan writable {}
+}
+
+# Writes the list of chunks $chunks to the cep $chan with a single
+# system call. Whatever the system doesn't take is kept in state(unsent).
+# Returns true if everything has been written.
+proc ::dbus::OutQueueWritev {chan chunks} {
+	variable $chan; upvar 0 $chan state
+
+	unset -nocomplain state(unsent)
+	set n [::cep::writev $chan $chunks]
+
+	# Skip the chunks written out completely:
+	set i 0
+	foreach chunk $chunks {
+		set len [string length $chunk]
+		if {$n < $len} break
+		incr n -$len
+		incr i
+	}
+	if {$i == [llength $chunks]} {
+		return 1
+	}
+
+	set state(unsent) [lreplace $chunks 0 $i \
+		[string range [lindex $chunks $i] $n end]]
+	return 0
+}
+
+# Sends a batch of messages from the send queue of the seqpacket
+# channel $chan, each one as a packet of its own, stopping early
+# if the socket's send buffer fills up.
+proc ::dbus::OutQueueSendPackets chan {
+	variable $chan; upvar 0 $chan state
+	global errorCode
+
+	set sent 0
+	while {$state(outqlen) > 0} {
+		set saved [OutQueueSave $chan]
+		set lane [OutQueueNextLane $chan]
+		set msg [join [lindex $state(outq,$lane) 0] ""]
+		if {[catch {::cep::send $chan $msg} err]} {
+			# The message stays queued until the channel is writable,
+			# and the lanes keep their credits and starvation counts:
+			OutQueueRestore $chan $saved
+			if {[string equal [lindex $errorCode 1] EAGAIN]} break
+			return -code error -errorcode $errorCode $err
+		}
+		set state(outq,$lane) [lreplace $state(outq,$lane) 0 0]
+		incr state(depth,$lane) -1
+		incr state(outqlen) -[string length $msg]
+		incr sent [string length $msg]
+		if {$sent >= $state(coalesce)} break
+	}
+}
@@ -0,0 +1,185 @@
+# $Id$
+# Pools of worker threads running method handlers.
+
+# Method handlers trapped with -pool run in the worker threads of
+# the given pool (created with the Thread package) instead of the thread
+# reading the connection, which only unmarshals calls and marshals
+# and sends replies. Each worker evaluates the -init script of the pool
+# first, which is expected to define the handlers.
+# Calls from the same sender are handled one after another in the order
+# they were received: while a sender has calls in flight, its further
+# calls are passed to the same worker, whose event queue runs them
+# in order. Otherwise the least busy worker is picked, so that calls
+# from different senders are handled in parallel.
+
+namespace eval ::dbus {
+	variable poolid 0
+
+	# Evaluated in each worker: runs a handler and passes its outcome
+	# back to the thread which owns the pool.
+	variable pool_worker_init {
+		namespace eval ::dbus {}
+		proc ::dbus::PoolWorkerRun {owner pool token cmd} {
+			global errorCode
+			if {[set code [catch {uplevel #0 $cmd} result]] == 1} {
+				set errorcode $errorCode
+			} else {
+				set errorcode NONE
+			}
+			thread::send -async $owner [list ::dbus::PoolDone \
+				$pool $token $code $result $errorcode]
+		}
+	}
+}
+
+# Creates or deletes a worker pool:
+# "pool create ?-size n? ?-init script?" returns the name of a new pool
+# of n (4 by default) workers;
+# "pool delete name" stops the workers of the pool; the calls they
+# haven't completed get error replies.
+proc ::dbus::pool {cmd args} {
+	switch -- $cmd {
+		create {
+			return [PoolCreate $args]
+		}
+		delete {
+			if {[llength $args] != 1} {
+				return -code error "wrong # args: should be\
+					\"[lindex [info level 0] 0] delete pool\""
+			}
+			set pool [lindex $args 0]
+			if {![PoolExists $pool]} {
+				return -code error "\"$pool\" is not a worker pool"
+			}
+			PoolDelete $pool
+		}
+		default {
+			return -code error "Bad subcommand \"$cmd\":\
+				must be create or delete"
+		}
+	}
+}
+
+proc ::dbus::PoolCreate opts {
+	variable poolid
+	variable pool_worker_init
+
+	set size 4
+	set init ""
+	while {[llength $opts] > 0} {
+		set opt [Pop opts]
+		switch -- $opt {
+			-size { set size [Pop opts] }
+			-init { set init [Pop opts] }
+			default {
+				return -code error "Bad option \"$opt\":\
+					must be one of -size or -init"
+			}
+		}
+	}
+	if {![string is integer -strict $size] || $size < 1} {
+		return -code error "Bad value for -size \"$size\":\
+			must be a positive integer"
+	}
+	package require Thread
+
+	set pool [namespace current]::pool$poolid
+	incr poolid
+	variable $pool; upvar 0 $pool state
+
+	set state(workers) [list]
+	set state(token)   0
+	for {set i 0} {$i < $size} {incr i} {
+		set tid [thread::create]
+		lappend state(workers) $tid
+		set state(busy,$tid) 0
+		if {[catch {
+			thread::send $tid $pool_worker_init
+			thread::send $tid $init
+		} err]} {
+			global errorInfo errorCode
+			set info $errorInfo
+			set code $errorCode
+			PoolDelete $pool
+			return -code error -errorinfo $info -errorcode $code \
+				"Worker initialization failed: $err"
+		}
+	}
+
+	set pool
+}
+
+proc ::dbus::PoolExists pool {
+	variable $pool
+	info exists ${pool}(workers)
+}
+
+proc ::dbus::PoolDelete pool {
+	variable $pool; upvar 0 $pool state
+
+	foreach tid $state(workers) {
+		thread::release $tid
+	}
+	set pending [list]
+	foreach key [array names state done,*] {
+		lappend pending [lindex $state($key) 2]
+	}
+	unset state
+
+	set reason "worker pool deleted"
+	foreach done $pending {
+		SafeCall eval $done [list 1 $reason [list DBUS POOL $reason]]
+	}
+}
+
+# Runs the command $cmd in a worker of $pool, choosing one already
+# busy with calls of the same $key if there is such.
+# Once it completes, $done is called in this thread with the completion
+# code, result and error code of $cmd appended.
+proc ::dbus::PoolRun {pool key cmd done} {
+	variable $pool; upvar 0 $pool state
+
+	if {![info exists state(workers)]} {
+		set reason "worker pool deleted"
+		eval $done [list 1 $reason [list DBUS POOL $reason]]
+		return
+	}
+
+	if {[info exists state(owner,$key)]} {
+		set tid $state(owner,$key)
+	} else {
+		set tid ""
+		foreach worker $state(workers) {
+			if {$tid == "" || $state(busy,$worker) < $state(busy,$tid)} {
+				set tid $worker
+			}
+		}
+		set state(owner,$key)    $tid
+		set state(inflight,$key) 0
+	}
+	incr state(busy,$tid)
+	incr state(inflight,$key)
+
+	set token [incr state(token)]
+	set state(done,$token) [list $tid $key $done]
+	thread::send -async $tid [list ::dbus::PoolWorkerRun \
+		[thread::id] $pool $token $cmd]
+}
+
+# Called from a worker of $pool once it has run the command identified
+# by $token.
+proc ::dbus::PoolDone {pool token code result errorcode} {
+	variable $pool; upvar 0 $pool state
+
+	# The pool might have been deleted meanwhile:
+	if {![info exists state(done,$token)]} return
+
+	foreach {tid key done} $state(done,$token) break
+	unset state(done,$token)
+	incr state(busy,$tid) -1
+	if {[incr state(inflight,$key) -1] == 0} {
+		unset state(inflight,$key) state(owner,$key)
+	}
+
+	SafeCall eval $done [list $code $result $errorcode]
+}
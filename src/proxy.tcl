@@ -0,0 +1,346 @@
+# $Id$
+# Proxies of remote objects generated from their introspection data.
+
+# The proxy of an object is a namespace holding a command per method
+# of the object, calling it, and a command per signal, registering
+# a handler of it. The commands are created from the list of members
+# parsed out of the introspection data of the object. With -cache,
+# the list is kept on disk, named after the SHA1 digest of the data,
+# along with a file recording which list was parsed for which object,
+# so that the next time the proxy of the same object is created
+# (by this process or another one) the list is loaded without
+# introspecting the object and parsing the data again.
+# The list is read back as data, and checked, rather than evaluated.
+# The cache directory is created accessible to its owner only, and
+# neither it nor the files in it are used if they aren't owned by
+# the current user or are writable by others.
+
+# Creates the proxy of the object $path of $dest connected via $chan in
+# the namespace given with -namespace (by default, the one named after
+# the last element of $path, relative to the current namespace) and
+# returns its name. The methods are called, and the handlers of signals
+# registered, with "ns::member ?arg ...?" and "ns::signal ?command?";
+# members defined by several interfaces are named "interface.member".
+# -refresh makes the object be introspected even if -cache has
+# its members already.
+proc ::dbus::proxy {chan dest path args} {
+	set ns ""
+	set cache ""
+	set refresh 0
+
+	while {[llength $args] > 0} {
+		set opt [Pop args]
+		switch -- $opt {
+			-namespace { set ns [Pop args] }
+			-cache     { set cache [Pop args] }
+			-refresh   { set refresh 1 }
+			default {
+				return -code error "Bad option \"$opt\":\
+					must be one of -namespace, -cache or -refresh"
+			}
+		}
+	}
+
+	if {$ns == ""} {
+		set ns [lindex [split [string trimright $path /] /] end]
+		if {$ns == ""} {
+			return -code error "Can't name the proxy of \"$path\":\
+				use -namespace"
+		}
+	}
+	if {![string match ::* $ns]} {
+		set current [uplevel 1 namespace current]
+		if {![string equal $current ::]} {
+			append current ::
+		}
+		set ns $current$ns
+	}
+
+	if {$cache != "" && ![ProxyCacheInit $cache]} {
+		set cache ""
+	}
+
+	set members ""
+	if {$cache != "" && !$refresh} {
+		set members [ProxyCacheLookup $cache $dest $path]
+	}
+	if {$members == ""} {
+		set xml [lindex [invoke $chan $path \
+			org.freedesktop.DBus.Introspectable.Introspect \
+			-destination $dest -out s] 0]
+		if {$cache != ""} {
+			set digest [ProxyDigest $xml]
+			set members [ProxyCacheRead $cache $digest]
+		}
+		if {$members == ""} {
+			set members [ProxyParse $xml]
+			if {$cache != ""} {
+				ProxyCacheStore $cache $digest $members
+			}
+		}
+		if {$cache != ""} {
+			ProxyCacheRecord $cache $dest $path $digest
+		}
+	}
+
+	ProxyLoad $chan $dest $path $ns $members
+	set ns
+}
+
+# Creates in $ns the commands of the proxy of the object $path of $dest
+# connected via $chan from the list of members returned by ProxyParse.
+proc ::dbus::ProxyLoad {chan dest path ns members} {
+	namespace eval $ns {}
+
+	foreach member $members {
+		set name [lindex $member 2]
+		if {[info exists seen($name)]} {
+			incr seen($name)
+		} else {
+			set seen($name) 1
+		}
+	}
+
+	foreach member $members {
+		foreach {kind iface name sig} $member break
+		set imethod $iface.$name
+		if {$seen($name) > 1} {
+			set name $imethod
+		}
+		if {$kind == "method"} {
+			ProxyMethod $chan $dest $path $ns $name $imethod $sig
+		} else {
+			ProxySignal $chan $dest $path $ns $name $imethod $sig
+		}
+	}
+}
+
+# Creates the command $name in $ns calling the method $imethod of
+# the object $path of $dest with arguments of the signature $sig.
+# The template of the calls is freed along with the command.
+proc ::dbus::ProxyMethod {chan dest path ns name imethod sig} {
+	set tmpl [prepare invoke $path $imethod -in $sig -destination $dest]
+	proc ${ns}::$name args [format {::dbus::TemplateSend %s %s $args {} 0 {}} \
+		[list $chan] [list $tmpl]]
+	trace add command ${ns}::$name delete [list ::dbus::TemplateFree $tmpl]
+}
+
+# Creates the command $name in $ns registering (or, given an empty
+# command, removing) the handler of the signal $imethod with arguments
+# of the signature $sig emitted by the object $path of $dest.
+proc ::dbus::ProxySignal {chan dest path ns name imethod sig} {
+	proc ${ns}::$name {{command ""}} [format {::dbus::ProxyHook %s $command} \
+		[list $chan $dest $path $imethod $sig]]
+}
+
+# Registers $command as the handler of the signal $imethod of the object
+# $path of $dest. On a message bus, also asks the bus to route the signal
+# to this connection, or not to, once the handler is removed.
+proc ::dbus::ProxyHook {chan dest path imethod sig command} {
+	variable $chan; upvar 0 $chan state
+
+	trap $chan $imethod $command -object $path -signature $sig
+
+	if {![info exists state(bus)] || !$state(bus)} return
+
+	SplitMemberName $imethod iface member
+	set rule "type='signal',path='$path',interface='$iface',member='$member'"
+	if {$dest != ""} {
+		append rule ",sender='$dest'"
+	}
+	if {$command != ""} {
+		if {[info exists state(match,$rule)]} return
+		set state(match,$rule) 1
+		set call AddMatch
+	} else {
+		if {![info exists state(match,$rule)]} return
+		unset state(match,$rule)
+		set call RemoveMatch
+	}
+	invoke $chan /org/freedesktop/DBus org.freedesktop.DBus.$call \
+		-destination org.freedesktop.DBus -in s -ignoreresult -- $rule
+}
+
+# Parses the introspection data $xml and returns the list of methods
+# and signals of the object it describes. Each element is a list of
+# the kind of the member (method or signal), its interface, name and
+# the signature of its (input) arguments.
+# Only the interfaces of the object itself are looked at, not those
+# of its children.
+proc ::dbus::ProxyParse xml {
+	regsub -all {<!--.*?-->} $xml "" xml
+	regsub -all {<[!?][^>]*>} $xml "" xml
+
+	set members [list]
+	set depth 0
+	set iface ""
+	set kind ""
+	foreach {- close tag attrs empty} \
+			[regexp -all -inline {<(/?)([\w:]+)((?:[^>/"']|"[^"]*"|'[^']*')*)(/?)>} $xml] {
+		array unset attr
+		foreach {- name dquoted squoted} \
+				[regexp -all -inline {([\w:]+)\s*=\s*(?:"([^"]*)"|'([^']*)')} $attrs] {
+			set attr($name) [string map \
+				{&lt; < &gt; > &quot; \" &apos; ' &amp; &} $dquoted$squoted]
+		}
+
+		if {$tag == "node"} {
+			if {$close != ""} {
+				incr depth -1
+			} elseif {$empty == ""} {
+				incr depth
+			}
+			continue
+		}
+		if {$depth != 1} continue
+
+		switch -- $tag {
+			interface {
+				if {$close != ""} {
+					set iface ""
+				} elseif {[info exists attr(name)]} {
+					set iface $attr(name)
+				}
+			}
+			method -
+			signal {
+				if {$close == "" && $iface != "" && [info exists attr(name)]} {
+					set kind $tag
+					set member $attr(name)
+					set sig ""
+				}
+				if {($close != "" || $empty != "") && $kind != ""} {
+					lappend members [list $kind $iface $member $sig]
+					set kind ""
+				}
+			}
+			arg {
+				if {$kind == "" || ![info exists attr(type)]} continue
+				if {$kind == "signal" || ![info exists attr(direction)]
+						|| $attr(direction) == "in"} {
+					append sig $attr(type)
+				}
+			}
+		}
+	}
+
+	set members
+}
+
+# Returns the hexadecimal SHA1 digest of the introspection data $xml.
+proc ::dbus::ProxyDigest xml {
+	package require sha1
+	string tolower [sha1::sha1 -hex [encoding convertto utf-8 $xml]]
+}
+
+# Makes sure the cache directory $dir exists and can be trusted,
+# creating it accessible to the current user only if it doesn't exist.
+proc ::dbus::ProxyCacheInit dir {
+	if {![file isdirectory $dir]} {
+		if {[catch {
+			file mkdir $dir
+			file attributes $dir -permissions 0700
+		}]} {
+			return 0
+		}
+	}
+	ProxyCacheTrusted $dir
+}
+
+# Returns true if the file $name is owned by the current user
+# and can't be written by anybody else.
+proc ::dbus::ProxyCacheTrusted name {
+	global tcl_platform
+
+	if {![string equal $tcl_platform(platform) unix]} {
+		return [file owned $name]
+	}
+	if {![file owned $name]
+			|| [catch {file attributes $name -permissions} perms]} {
+		return 0
+	}
+	scan $perms %o perms
+	expr {($perms & 0022) == 0}
+}
+
+# Returns the list of members cached in $dir for the object $path
+# of $dest or an empty string if there's none.
+proc ::dbus::ProxyCacheLookup {dir dest path} {
+	set ref [file join $dir [ProxyDigest "$dest $path"].ref]
+	if {[catch {ProxyCacheFile $ref} digest]} {
+		return ""
+	}
+	ProxyCacheRead $dir [string trim $digest]
+}
+
+# Returns the list of members cached in $dir parsed from the introspection
+# data with the SHA1 digest $digest or an empty string if there's none
+# or it's malformed.
+proc ::dbus::ProxyCacheRead {dir digest} {
+	if {![regexp {^[0-9a-f]+$} $digest]
+			|| [catch {ProxyCacheFile [file join $dir $digest.proxy]} members]
+			|| [catch {llength $members}]} {
+		return ""
+	}
+	foreach member $members {
+		if {[catch {llength $member} len] || $len != 4} {
+			return ""
+		}
+		foreach {kind iface name sig} $member break
+		if {[lsearch -exact {method signal} $kind] < 0
+				|| ![SplitMemberName $iface.$name i n]
+				|| ![string equal $i.$n $iface.$name]
+				|| [catch {SigParseCached $sig}]} {
+			return ""
+		}
+	}
+	set members
+}
+
+# Returns the contents of the file $name, provided it can be trusted.
+proc ::dbus::ProxyCacheFile name {
+	if {![ProxyCacheTrusted $name]} {
+		return -code error "\"$name\" can't be trusted"
+	}
+	set fd [open $name]
+	fconfigure $fd -encoding utf-8
+	set data [read $fd]
+	close $fd
+	set data
+}
+
+# Stores in $dir the list of members $members parsed from the introspection
+# data with the SHA1 digest $digest, one member per line.
+# The cache is only an optimization, so failures to update it are ignored.
+proc ::dbus::ProxyCacheStore {dir digest members} {
+	set data ""
+	foreach member $members {
+		append data [list $member] \n
+	}
+	catch {ProxyCacheWrite [file join $dir $digest.proxy] $data}
+}
+
+# Records in $dir the list of members parsed from the introspection data
+# with the SHA1 digest $digest as the one for the object $path of $dest.
+proc ::dbus::ProxyCacheRecord {dir dest path digest} {
+	catch {
+		ProxyCacheWrite [file join $dir [ProxyDigest "$dest $path"].ref] \
+			$digest\n
+	}
+}
+
+# Writes $data to the file $name, readable and writable by the current
+# user only, replacing it at once so that other processes never read it
+# partially written.
+proc ::dbus::ProxyCacheWrite {name data} {
+	set temp $name.[pid]
+	set fd [open $temp {WRONLY CREAT TRUNC} 0600]
+	fconfigure $fd -encoding utf-8
+	if {[catch {puts -nonewline $fd $data} err]} {
+		close $fd
+		file delete $temp
+		return -code error $err
+	}
+	close $fd
+	file rename -force $temp $name
+}
@@ -54,20 +54,41 @@ proc ::dbus::StreamTearDown {chan reason} {
 	variable $chan; upvar 0 $chan state
 	upvar 0 state(command) command
 
-	close $chan
-
-	ReleaseReplyWaiters $chan error $errorCode $reason
-
 	if {[info exists command]} {
 		set cmd [list $command $chan receive error $errorCode $reason]
 	} else {
 		set cmd [MyCmd streamerror $chan receive error $errorCode $reason]
 	}
-	variable $state(msgid); unset $state(msgid)
-	unset state
+	ChanFree $chan $errorCode $reason
 	uplevel #0 $cmd
 }
 
+# Closes $chan, unless that has been done already, and frees its state:
+# its handlers, held signals and incoming messages are discarded, and
+# the calls awaiting replies fail with the error code $errorcode and
+# the message $reason.
+proc ::dbus::ChanFree {chan errorcode reason} {
+	variable $chan; upvar 0 $chan state
+	variable traps
+
+	catch {close $chan}
+	array unset traps $chan,*
+	SignalsFree $chan
+
+	ReleaseReplyWaiters $chan error $errorcode $reason
+
+	if {[info exists state(flushid)]} {
+		after cancel $state(flushid)
+	}
+	if {[info exists state(msgid)]} {
+		MessageDelete $state(msgid)
+	}
+	if {[info exists state(inq)]} {
+		InQueueFree $chan
+	}
+	unset state
+}
+
 proc ::dbus::MalformedStream reason {
 	return -code error -errorcode [list DBUS FORMAT $reason] $reason
 }
@@ -94,15 +115,21 @@ proc ::dbus::ChanAppend {chan n script} {
 }
 
 proc ::dbus::ChanAsyncRead chan {
+	variable $chan; upvar 0 $chan state
+
+	if {$state(packets)} {
+		ChanReadPacket $chan
+		return
+	}
+
 	if {[eof $chan]} {
 		StreamTearDown $chan "unexpected remote disconnect"
 	}
 
-	variable $chan; upvar 0 $chan state
 	upvar 0 state(buffer) buffer state(wanted) wanted
 
 	append buffer [read $chan $wanted]
-	set wanted [expr {[string length $buffer] - $state(expected)}]
+	set wanted [expr {$state(expected) - [string length $buffer]}]
 	if {$wanted == 0} {
 		if {[catch [linsert $state(script) end $buffer] err]} {
 			StreamTearDown $chan $err
@@ -110,6 +137,119 @@ proc ::dbus::ChanAsyncRead chan {
 	}
 }
 
+# Reads the next packet from the seqpacket channel $chan with a single
+# recv() call and feeds it to the reader steps set up by ChanRead.
+# Since the packet holds a whole message, the steps are run back to back
+# without returning to the event loop; the packet must end exactly where
+# a message does.
+proc ::dbus::ChanReadPacket chan {
+	variable $chan; upvar 0 $chan state
+	global errorCode
+
+	if {[catch {::cep::recv $chan} packet]} {
+		# Spurious readability:
+		if {[string equal [lindex $errorCode 1] EAGAIN]} return
+		StreamTearDown $chan $packet
+		return
+	}
+	if {[string length $packet] == 0} {
+		StreamTearDown $chan "unexpected remote disconnect"
+		return
+	}
+
+	ChanProcessPacket $chan $packet
+}
+
+# Feeds $packet, which holds one or more whole messages, to the reader
+# steps of $chan set up by ChanRead.
+proc ::dbus::ChanProcessPacket {chan packet} {
+	variable $chan; upvar 0 $chan state
+
+	set len [string length $packet]
+	set ix 0
+	while {$ix < $len} {
+		set end [expr {$ix + $state(wanted)}]
+		if {$end > $len} {
+			catch {MalformedStream "truncated message in packet"} err
+			StreamTearDown $chan $err
+			return
+		}
+		append state(buffer) [string range $packet $ix [expr {$end - 1}]]
+		set ix $end
+		if {[catch [linsert $state(script) end $state(buffer)] err]} {
+			StreamTearDown $chan $err
+			return
+		}
+	}
+	if {![string equal [lindex $state(script) 0] ProcessHeaderPrologue]} {
+		catch {MalformedStream "truncated message in packet"} err
+		StreamTearDown $chan $err
+	}
+}
+
+# Handles an event posted by the reader thread of $chan
+# (see ChanSelectReader): $status is one of those of
+# [cep::dbusreader] and $data is either a whole message
+# or the reason the reader has stopped.
+proc ::dbus::ChanReaderEvent {chan status data} {
+	switch -- $status {
+		message {
+			ChanProcessPacket $chan $data
+		}
+		eof {
+			StreamTearDown $chan "unexpected remote disconnect"
+		}
+		malformed {
+			catch {MalformedStream $data} err
+			StreamTearDown $chan $err
+		}
+		default {
+			StreamTearDown $chan $data
+		}
+	}
+}
+
+# Makes $chan be read the way its -iothread option asks for, unless
+# it already is: either from its readable fileevent or, with -iothread
+# set, by a thread of ceptcl which splits the stream into messages
+# and hands them over whole through the event queue.
+# Must be called between messages.
+proc ::dbus::ChanSelectReader chan {
+	variable $chan; upvar 0 $chan state
+
+	set reader [expr {[string is true $state(iothread)] ? "thread" : "event"}]
+	if {[string equal $state(reader) $reader]} return
+
+	switch -- $state(reader) {
+		thread { ::cep::dbusreader stop $chan }
+		event  { fileevent $chan readable {} }
+	}
+	set state(reader) $reader
+
+	if {[string equal $reader thread]} {
+		::cep::dbusreader start $chan \
+			-maxmessage $state(maxmessage) -maxbuffered $state(maxbuffered) \
+			[MyCmd ChanReaderEvent $chan]
+		if {$state(suspended)} {
+			::cep::dbusreader pause $chan
+		}
+	} elseif {!$state(suspended)} {
+		fileevent $chan readable [MyCmd ChanAsyncRead $chan]
+	}
+}
+
+# Restarts the reader thread of $chan, if any, so that it picks up
+# changed limits.
+proc ::dbus::ChanRestartReader chan {
+	variable $chan; upvar 0 $chan state
+
+	if {[info exists state(reader)] && [string equal $state(reader) thread]} {
+		::cep::dbusreader stop $chan
+		set state(reader) none
+		ChanSelectReader $chan
+	}
+}
+
 proc ::dbus::ChanNewMessage chan {
 	variable $chan; upvar 0 $chan state
 
@@ -441,6 +581,91 @@ proc ::dbus::UnmarshalArrayElements {buf LE etype alen ixVar} {
 	set out
 }
 
+# Unmarshals the body of the message $msgid into msg(params), stopping
+# early once the clock reaches $deadline (in milliseconds, as returned
+# by [clock clicks -milliseconds]) unless it's 0. Top-level arguments
+# are unmarshaled whole, except for arrays, whose elements are taken
+# in batches, so a huge body can be spread over several calls.
+# Returns true once the whole body is unmarshaled.
+proc ::dbus::MessageDecode {msgid deadline} {
+	variable $msgid; upvar 0 $msgid msg
+	variable unmarshalers
+
+	if {[info exists msg(params)]} {
+		return 1
+	}
+	if {![info exists msg(decode)]} {
+		# The rest of the signature, offset into the body and the
+		# arguments unmarshaled so far:
+		set msg(decode) [list $msg(SIGNATURE) 0 [list]]
+	}
+	foreach {mlist ix out} $msg(decode) break
+	set msg(decode) {}
+	upvar 0 msg(body) buf msg(LE) LE
+
+	while 1 {
+		if {[info exists msg(array)]} {
+			# In the middle of a top-level array:
+			foreach {etype end items} $msg(array) break
+			set msg(array) {}
+			foreach {nestlvl type subtype} $etype break
+			if {$nestlvl > 1} {
+				set type ARRAY
+				set subtype [lreplace $etype 0 0 [expr {$nestlvl - 1}]]
+			}
+			set unmarshaler $unmarshalers($type)
+			while {$ix < $end} {
+				for {set i 0} {$i < 256 && $ix < $end} {incr i} {
+					lappend items [$unmarshaler $buf $LE $subtype ix]
+				}
+				if {$ix < $end && $deadline > 0
+						&& [clock clicks -milliseconds] >= $deadline} {
+					set msg(array)  [list $etype $end $items]
+					set msg(decode) [list $mlist $ix $out]
+					return 0
+				}
+			}
+			set ix $end
+			lappend out $items
+			unset msg(array)
+		}
+
+		if {[llength $mlist] == 0} break
+		# Each call makes some progress, however late it is:
+		if {$deadline > 0 && [info exists progress]
+				&& [clock clicks -milliseconds] >= $deadline} {
+			set msg(decode) [list $mlist $ix $out]
+			return 0
+		}
+		set progress 1
+
+		foreach {type subtype} $mlist break
+		set mlist [lrange $mlist 2 end]
+		if {[string equal $type ARRAY]} {
+			set alen [UnmarshalUint32 $buf $LE {} ix]
+			if {$alen > 0x04000000} {
+				MalformedStream "array length exceeds limit"
+			}
+			if {$alen == 0} {
+				lappend out {}
+				continue
+			}
+			# See UnmarshalArrayElements:
+			set end [expr {$ix + $alen}]
+			if {[lindex $subtype 0] == 1} {
+				incr end [PadSizeType $ix [lindex $subtype 1]]
+			}
+			set msg(array) [list $subtype $end [list]]
+		} else {
+			lappend out [$unmarshalers($type) $buf $LE $subtype ix]
+		}
+	}
+
+	unset msg(decode)
+	set msg(params) $out
+	return 1
+}
+
 proc ::dbus::UnmarshalList {buf LE mlist ixVar} {
 	upvar 1 $ixVar ix
 
@@ -453,8 +678,9 @@ proc ::dbus::UnmarshalList {buf LE mlist ixVar} {
 }
 
 proc ::dbus::ReadMessages chan {
-	fileevent $chan readable [MyCmd ChanAsyncRead $chan]
+	variable $chan; upvar 0 $chan state
 
+	set state(reader) none
 	ReadNextMessage $chan
 }
 
@@ -464,12 +690,14 @@ proc ::dbus::ReadNextMessage chan {
 	set msgid [ChanNewMessage $chan]
 
 	ChanRead $chan 16 [list ProcessHeaderPrologue $chan $msgid]
+	ChanSelectReader $chan
 }
 
 proc ::dbus::ProcessHeaderPrologue {chan msgid header} {
 	puts [lindex [info level 0] 0]
 
 	variable proto_major
+	variable $chan; upvar 0 $chan state
 	variable $msgid; upvar 0 $msgid msg
 
 	binary scan $header accc bytesex msgtype flags proto
@@ -496,7 +724,15 @@ proc ::dbus::ProcessHeaderPrologue {chan msgid header} {
 		MalformedStream "array length exceeds limit"
 	}
 
+	set size [expr {16 + $fsize + [PadSize $fsize 8] + $bodysize}]
+	if {$size > $state(maxmessage) || $size > $state(maxbuffered)} {
+		MalformedStream "message size exceeds limit"
+	}
+	set state(inflight) $size
+	InQueueThrottle $chan
+
 	set msg(header)   $header
+	set msg(size)     $size
 	set msg(typecode) $msgtype
 	set msg(flags)    $flags
 	set msg(serial)   $serial
@@ -536,20 +772,19 @@ proc ::dbus::ProcessHeaderFields {chan LE bsize msgid data} {
 	if {$bsize == 0} {
 		if {[info exists msg(SIGNATURE)]} {
 			MalformedStream "signature present while body size is 0"
-		} else {
-			DispatchIncomingMessage $chan $msgid
-			ReadNextMessage $chan
 		}
 	} else {
 		if {![info exists msg(SIGNATURE)]} {
 			MalformedStream "signature absent while body size is not 0"
 		}
-		set pad [PadSize $ix 8]
-		if {$pad > 0} {
-			ChanRead $chan $pad [list ProcessMessageBodyPadding $chan $LE $bsize $msgid]
-		} else {
-			ChanRead $chan $bsize [list ProcessMessageBody $chan $LE $msgid]
-		}
+	}
+
+	# The header is padded to 8 bytes even if there's no body:
+	set pad [PadSize $ix 8]
+	if {$pad > 0} {
+		ChanRead $chan $pad [list ProcessMessageBodyPadding $chan $LE $bsize $msgid]
+	} else {
+		ReadMessageBody $chan $LE $bsize $msgid
 	}
 }
 
@@ -560,7 +795,17 @@ proc ::dbus::ProcessMessageBodyPadding {chan LE bsize msgid padding} {
 		MalformedStream "non-zero padding"
 	}
 
-	ChanRead $chan $bsize [list ProcessMessageBody $chan $LE $msgid]
+	ReadMessageBody $chan $LE $bsize $msgid
+}
+
+proc ::dbus::ReadMessageBody {chan LE bsize msgid} {
+	if {$bsize == 0} {
+		set ${msgid}(params) [list]
+		QueueIncomingMessage $chan $msgid
+		ReadNextMessage $chan
+	} else {
+		ChanRead $chan $bsize [list ProcessMessageBody $chan $LE $msgid]
+	}
 }
 
 proc ::dbus::ProcessMessageBody {chan LE msgid body} {
@@ -568,13 +813,13 @@ proc ::dbus::ProcessMessageBody {chan LE msgid body} {
 
 	variable $msgid; upvar 0 $msgid msg
 
-	set ix 0
-	set msg(body)   $body
-	set msg(params) [UnmarshalList $body $LE $msg(SIGNATURE) ix]
+	# The body is unmarshaled right before the message is dispatched:
+	set msg(body) $body
+	set msg(LE)   $LE
 
 	parray msg
 
-	DispatchIncomingMessage $chan $msgid
+	QueueIncomingMessage $chan $msgid
 	ReadNextMessage $chan
 }
 
@@ -0,0 +1,83 @@
+# $Id$
+# Fixtures shared by the tests of D-Bus channels.
+
+# Creates a connected pair of TCP sockets (or, with -cep, of local stream
+# ceps) and returns one end set up as a D-Bus channel with per-connection
+# options $opts. The other end is stored in the global variable "peer".
+# With -reader, the channel reads incoming messages, and the peer is set
+# up as a D-Bus channel writing out each message right away, so that
+# messages can be sent from it. With -blocking, the channel is left
+# in blocking mode, so that tests can run its reader by hand.
+proc MakeChan args {
+	set cep 0
+	set reader 0
+	set blocking no
+	while {[llength $args] > 0} {
+		switch -- [lindex $args 0] {
+			-cep      { set cep 1 }
+			-reader   { set reader 1 }
+			-blocking { set blocking yes }
+			default   break
+		}
+		set args [lrange $args 1 end]
+	}
+	set opts [lindex $args 0]
+
+	if {$cep} {
+		foreach {chan ::peer} [cep -domain local] break
+	} else {
+		set srv [socket -server AcceptPeer -myaddr localhost 0]
+		set chan [socket localhost [lindex [fconfigure $srv -sockname] 2]]
+		vwait ::peer
+		close $srv
+	}
+	fconfigure $chan -translation binary -buffering none -blocking $blocking
+	fconfigure $::peer -translation binary -blocking no
+	::dbus::ChanInit $chan $opts
+	if {$reader} {
+		fconfigure $::peer -buffering none
+		::dbus::ChanInit $::peer {-coalesce 0}
+		::dbus::ReadMessages $chan
+	}
+	set chan
+}
+
+proc AcceptPeer {sock args} {
+	set ::peer $sock
+}
+
+# Frees the channel returned by MakeChan and its peer.
+proc FreeChan chan {
+	catch {close $chan}
+	close $::peer
+	unset -nocomplain ::dbus::$chan ::dbus::$::peer
+}
+
+# Frees the pair of D-Bus channels $pair returned by the loopback
+# endpoint, along with the handlers trapped on its server end.
+proc FreePair pair {
+	foreach chan $pair {
+		catch {close $chan}
+		unset -nocomplain ::dbus::$chan
+	}
+	array unset ::dbus::traps [lindex $pair 1],*
+}
+
+# Sends $n method calls with no body from the peer of MakeChan.
+proc SendCalls n {
+	for {set i 0} {$i < $n} {incr i} {
+		::dbus::invoke $::peer /org/example/Obj org.example.Iface.Member \
+			-ignoreresult
+	}
+}
+
+# Stands for the -command of a channel: keeps its last call in "record".
+proc Record args {
+	set ::record $args
+}
+
+# Execution trace of DispatchIncomingMessage: appends the channel
+# the message was dispatched on to "dispatched".
+proc Dispatched {cmd op} {
+	lappend ::dispatched [lindex $cmd 1]
+}